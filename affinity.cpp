@@ -0,0 +1,172 @@
+/*
+Copyright 2010, HudsonAlpha Institute for Biotechnology
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+affinity.cpp
+
+Which CPUs the pipeline's threads run on
+*/
+
+#include "affinity.h"
+#include "threads.h"
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+//Which of CpuPlacement's CPUs this thread has, or -1
+__thread int placed_on = -1;
+
+#ifdef __linux__
+bool pin(pthread_t thread, const vector<int> &cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < cpus.size(); i++)
+        CPU_SET(cpus[i], &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+#endif
+
+}
+
+bool parse_cpu_list(const char *text, vector<int> &cpus) {
+    cpus.clear();
+    const char *p = text;
+    for (;;) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0)
+            return false;
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first)
+                return false;
+            p = end;
+        }
+#ifdef CPU_SETSIZE
+        if (last >= CPU_SETSIZE)
+            return false;
+#endif
+        for (long cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+        if (*p != ',')
+            break;
+        p++;
+    }
+    return *p == '\0';
+}
+
+bool numa_node_cpus(int node, vector<int> &cpus) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    ifstream file(path);
+    string line;
+    if (!getline(file, line) || !parse_cpu_list(line.c_str(), cpus)) {
+        cerr << "ERROR: there's no NUMA node " << node << " with any CPUs" << endl;
+        return false;
+    }
+    return true;
+}
+
+bool CpuPlacement::set_cpus(const vector<int> &cpus) {
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        CPU_ZERO(&allowed);
+    vector<int> usable;
+    for (size_t i = 0; i < cpus.size(); i++) {
+        if (CPU_ISSET(cpus[i], &allowed))
+            usable.push_back(cpus[i]);
+    }
+    if (usable.empty()) {
+        cerr << "ERROR: none of the CPUs asked for are available" << endl;
+        return false;
+    }
+    if (!pin(pthread_self(), vector<int>(1, usable[0]))) {
+        cerr << "ERROR: could not pin to CPU " << usable[0] << ": " << strerror(errno) << endl;
+        return false;
+    }
+    ScopedLock lock(m_mutex);
+    m_cpus = usable;
+    m_taken.assign(usable.size(), false);
+    m_taken[0] = true;
+    return true;
+#else
+    cerr << "ERROR: threads can only be pinned to CPUs on Linux" << endl;
+    return false;
+#endif
+}
+
+size_t CpuPlacement::cpus() {
+    ScopedLock lock(m_mutex);
+    return m_cpus.size();
+}
+
+void CpuPlacement::started() {
+#ifdef __linux__
+    ScopedLock lock(m_mutex);
+    if (m_cpus.empty())
+        return;
+    size_t i = find(m_taken.begin(), m_taken.end(), false) - m_taken.begin();
+    //Doubling up threads on some CPUs would leave others idle, so the
+    //extra ones are left to the scheduler
+    if (i == m_cpus.size()) {
+        pin(pthread_self(), m_cpus);
+        return;
+    }
+    if (pin(pthread_self(), vector<int>(1, m_cpus[i]))) {
+        m_taken[i] = true;
+        placed_on = i;
+    }
+#endif
+}
+
+void CpuPlacement::finished() {
+    ScopedLock lock(m_mutex);
+    if (placed_on >= 0 && size_t(placed_on) < m_taken.size())
+        m_taken[placed_on] = false;
+    placed_on = -1;
+}
+
+bool prefer_numa_node(int node) {
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+    //MPOL_PREFERRED, from numaif.h, which not everyone has installed
+    const int preferred = 1;
+    const size_t bits = 8 * sizeof(unsigned long);
+    //The kernel leaves off the last bit it's told about
+    vector<unsigned long> mask(node / bits + 2, 0);
+    mask[node / bits] |= 1UL << (node % bits);
+    if (syscall(SYS_set_mempolicy, preferred, &mask[0], mask.size() * bits) == 0)
+        return true;
+    cerr << "ERROR: could not have memory allocated on NUMA node " << node << ": "
+         << strerror(errno) << endl;
+    return false;
+#else
+    cerr << "ERROR: NUMA nodes can only be chosen on Linux" << endl;
+    return false;
+#endif
+}
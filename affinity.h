@@ -0,0 +1,69 @@
+/*
+Copyright 2010, HudsonAlpha Institute for Biotechnology
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+affinity.h
+
+Which CPUs the pipeline's threads run on
+*/
+
+#ifndef BAM2FASTQ_AFFINITY_H
+#define BAM2FASTQ_AFFINITY_H
+
+#include "threads.h"
+#include <stddef.h>
+#include <vector>
+
+//Parses CPU lists like 0-7,16-23, the way taskset -c and sysfs write them.
+//False if it isn't one.
+bool parse_cpu_list(const char *text, std::vector<int> &cpus);
+
+//The CPUs of a NUMA node, from sysfs.  False (after a message) if there's
+//no such node.
+bool numa_node_cpus(int node, std::vector<int> &cpus);
+
+//Pins each thread it's told about to a CPU of its own, the first free
+//one in the list, so the threads of each stage, which start together,
+//end up next to each other.  A thread's CPU is free again once it
+//finishes.  While every CPU has one, more threads may run on any of them.
+//Install it as the thread_observer().
+class CpuPlacement : public ThreadObserver {
+public:
+    CpuPlacement() {}
+
+    //Uses cpus from then on, and pins the calling thread to the first of
+    //them for good.  CPUs we aren't allowed to use are dropped.  False
+    //(after a message) if that leaves none, or it can't be done here.
+    bool set_cpus(const std::vector<int> &cpus);
+    //How many CPUs set_cpus() kept
+    size_t cpus();
+
+    void started();
+    void finished();
+
+private:
+    CpuPlacement(const CpuPlacement &);
+    CpuPlacement &operator=(const CpuPlacement &);
+
+    Mutex m_mutex;
+    std::vector<int> m_cpus;
+    std::vector<bool> m_taken;
+};
+
+//Has memory allocated from then on, by this thread and the ones it
+//starts, come from node where possible.  False (after a message) if the
+//system won't.
+bool prefer_numa_node(int node);
+
+#endif
@@ -19,29 +19,127 @@ Written by Phillip Dexheimer
 */
 
 #include "sam.h"
+#include "bam_input.h"
+#include "threads.h"
+#include "pair_table.h"
+#include "decode.h"
+#include "output.h"
+#include "read_groups.h"
+#include "stats.h"
+#include "checkpoint.h"
+#include "affinity.h"
 #include <getopt.h>
-#include <map>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <string>
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <iomanip>
 #include <vector>
+#include <map>
 #include <algorithm>
 #include <cctype>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
 
 using namespace std;
 
 const char version[] = "1.1.0";
-const char shortopts[] = "o:vhfqs";
+const char shortopts[] = "o:t:vhfqs";
 
 int save_aligned = 1;
 int save_unaligned = 1;
 int save_filtered = 1;
+//Secondary and supplementary alignments are copies of reads we already
+//have, so they're skipped unless they're asked for
+int save_secondary = 0;
+const char *secondary_path = NULL;
+OutputBuffer *secondary_output = NULL;
+//Like samtools view -f and -F
+int require_flags = 0;
+int exclude_flags = 0;
 int overwrite_files = 0;
 int stdout_pairs = 0;
 int stdout_all = 0;
+//Where the unpaired reads go with --pairs-to-stdout
+const char *unpaired_path = "unpaired_reads.fastq";
+//Buffers of stdout waiting for the thread that writes them
+size_t stdout_queue = 4;
+//--checkpoint, every checkpoint_interval seconds
+const char *checkpoint_path = NULL;
+int checkpoint_interval = 300;
+int resume = 0;
+//For decoding CRAM
+const char *samtools_path = "samtools";
+const char *reference_path = NULL;
 int print_msgs = 1;
 int strict = 0;
+int threads = 1;
+size_t max_memory = 0;
+size_t write_buffer = 8 << 20;
+//--compress, or NULL for plain text
+const char *compress_format = NULL;
+int compress_level = 6;
+//0 means the same as --threads
+int compress_threads = 0;
+Compressor *compressor = NULL;
+//Sets of output files kept open when they're split by lane or read group
+size_t max_open = 32;
+//--split-reads and --split-bytes: how big each {chunk} of output gets, or
+//0 for no limit
+size_t split_reads = 0;
+size_t split_bytes = 0;
+//--cpus, or NULL to leave the threads to the scheduler, and --numa-node,
+//or -1
+const char *cpu_list = NULL;
+int numa_node = -1;
+//-1 means go by the SO tag in the header
+int collated = -1;
+int by_contig = 0;
+int by_offset = 0;
+int parallel_inputs = 0;
+//"text" or "json"
+const char *stats_format = NULL;
+//Seconds between progress reports; 0 for none
+int progress_interval = 0;
+int use_mmap = 0;
+vector<string> regions;
+//--quality-offset, --name-suffix, --tags, --use-oq and --index-reads
+FastqFormat fastq_format;
+
+//Long options without a short equivalent
+enum {
+    OPT_MAX_MEMORY = 256,
+    OPT_REGION,
+    OPT_QUALITY_OFFSET,
+    OPT_WRITE_BUFFER,
+    OPT_COMPRESS,
+    OPT_COMPRESS_LEVEL,
+    OPT_COMPRESS_THREADS,
+    OPT_MAX_OPEN,
+    OPT_REQUIRE_FLAGS,
+    OPT_EXCLUDE_FLAGS,
+    OPT_SECONDARY_OUTPUT,
+    OPT_STATS,
+    OPT_PROGRESS,
+    OPT_UNPAIRED_OUTPUT,
+    OPT_STDOUT_QUEUE,
+    OPT_REFERENCE,
+    OPT_SAMTOOLS,
+    OPT_NAME_SUFFIX,
+    OPT_TAGS,
+    OPT_USE_OQ,
+    OPT_INDEX_READS,
+    OPT_CHECKPOINT,
+    OPT_CHECKPOINT_INTERVAL,
+    OPT_SPLIT_READS,
+    OPT_SPLIT_BYTES,
+    OPT_CPUS,
+    OPT_NUMA_NODE
+};
 
 static struct option longopts[] = {
     { "help",            no_argument,       NULL,           'h' },
@@ -50,6 +148,17 @@ static struct option longopts[] = {
     { "force",           no_argument,       NULL,           'f' },
     { "quiet",           no_argument,       NULL,           'q' },
     { "strict",          no_argument,       NULL,           's' },
+    { "threads",         required_argument, NULL,           't' },
+    { "max-memory",      required_argument, NULL,           OPT_MAX_MEMORY },
+    { "region",          required_argument, NULL,           OPT_REGION },
+    { "quality-offset",  required_argument, NULL,           OPT_QUALITY_OFFSET },
+    { "write-buffer",    required_argument, NULL,           OPT_WRITE_BUFFER },
+    { "compress",        required_argument, NULL,           OPT_COMPRESS },
+    { "compress-level",  required_argument, NULL,           OPT_COMPRESS_LEVEL },
+    { "compress-threads",required_argument, NULL,           OPT_COMPRESS_THREADS },
+    { "max-open",        required_argument, NULL,           OPT_MAX_OPEN },
+    { "require-flags",   required_argument, NULL,           OPT_REQUIRE_FLAGS },
+    { "exclude-flags",   required_argument, NULL,           OPT_EXCLUDE_FLAGS },
     { "overwrite",       no_argument,       &overwrite_files,0  },
     { "aligned",         no_argument,       &save_aligned,   1  },
     { "no-aligned",      no_argument,       &save_aligned,   0  },
@@ -57,26 +166,122 @@ static struct option longopts[] = {
     { "no-unaligned",    no_argument,       &save_unaligned, 0  },
     { "filtered",        no_argument,       &save_filtered,  1  },
     { "no-filtered",     no_argument,       &save_filtered,  0  },
+    { "secondary",       no_argument,       &save_secondary, 1  },
+    { "no-secondary",    no_argument,       &save_secondary, 0  },
+    { "secondary-output", required_argument, NULL,          OPT_SECONDARY_OUTPUT },
+    { "stats",           optional_argument, NULL,           OPT_STATS },
+    { "progress",        optional_argument, NULL,           OPT_PROGRESS },
     { "pairs-to-stdout", no_argument,       &stdout_pairs,   1  },
     { "all-to-stdout",   no_argument,       &stdout_all,     1  },
+    { "unpaired-output", required_argument, NULL,           OPT_UNPAIRED_OUTPUT },
+    { "stdout-queue",    required_argument, NULL,           OPT_STDOUT_QUEUE },
+    { "reference",       required_argument, NULL,           OPT_REFERENCE },
+    { "samtools",        required_argument, NULL,           OPT_SAMTOOLS },
+    { "name-suffix",     required_argument, NULL,           OPT_NAME_SUFFIX },
+    { "tags",            required_argument, NULL,           OPT_TAGS },
+    { "use-oq",          no_argument,       NULL,           OPT_USE_OQ },
+    { "index-reads",     no_argument,       NULL,           OPT_INDEX_READS },
+    { "checkpoint",      required_argument, NULL,           OPT_CHECKPOINT },
+    { "checkpoint-interval",required_argument,NULL,         OPT_CHECKPOINT_INTERVAL },
+    { "split-reads",     required_argument, NULL,           OPT_SPLIT_READS },
+    { "split-bytes",     required_argument, NULL,           OPT_SPLIT_BYTES },
+    { "cpus",            required_argument, NULL,           OPT_CPUS },
+    { "numa-node",       required_argument, NULL,           OPT_NUMA_NODE },
+    { "resume",          no_argument,       &resume,         1  },
+    { "collated",        no_argument,       &collated,       1  },
+    { "no-collated",     no_argument,       &collated,       0  },
+    { "by-contig",       no_argument,       &by_contig,      1  },
+    { "by-offset",       no_argument,       &by_offset,      1  },
+    { "parallel-inputs", no_argument,       &parallel_inputs, 1 },
+    { "mmap",            no_argument,       &use_mmap,       1  },
     { NULL,           0,                 NULL,            0  }
 };
 
 void usage(int error=1) {
     cerr << "bam2fastq v" << version << " - extract sequences from a BAM file" << endl
          << endl
-         << "Usage: bam2fastq [options] <bam file>" << endl
+         << "Usage: bam2fastq [options] <bam file>..." << endl
+         << endl
+         << "Several BAM files are read one after the other into the same output files," << endl
+         << "as if they were one.  - reads a BAM file from stdin." << endl
          << endl
          << "Options:" << endl
          << "  -o FILENAME, --output FILENAME" << endl
          << "       Specifies the name of the FASTQ file(s) that will be generated.  May" << endl
          << "       contain the special characters % (replaced with the lane number) and" << endl
          << "       # (replaced with _1 or _2 to distinguish PE reads, _M for unpaired reads)." << endl
+         << "       {rg} is replaced with the read's RG tag, with characters other than" << endl
+         << "       letters, digits and -_.+ written as %XX, or with %none for reads" << endl
+         << "       that have no tag.  With % or {rg}, each lane or read group gets" << endl
+         << "       its own files.  {chunk} is replaced with the number" << endl
+         << "       of the chunk, with --split-reads or --split-bytes." << endl
          << "       [Default: s_%#_sequence.txt]" << endl << endl
+         << "  --split-reads N" << endl
+         << "  --split-bytes SIZE" << endl
+         << "       Start the next {chunk} of files (0001, 0002...) once N pairs and" << endl
+         << "       single-end reads, or SIZE bytes of FASTQ before any compression," << endl
+         << "       have gone into one.  Both reads of a pair are always in the same" << endl
+         << "       chunk, and each one is finished off and closed as soon as it's full," << endl
+         << "       so it can be used while the rest are still being written." << endl << endl
+         << "  --max-open N" << endl
+         << "       Keep the files of at most N lanes or read groups open at once, closing" << endl
+         << "       and later reopening the least recently used [Default: 32]" << endl << endl
          << "  --pairs-to-stdout" << endl
          << "       Write the paired reads to stdout " << endl << endl
+         << "  --unpaired-output FILE" << endl
+         << "       With --pairs-to-stdout, write the unpaired reads to FILE, which may" << endl
+         << "       be a FIFO or /dev/fd/N for a descriptor the caller has opened" << endl
+         << "       [Default: unpaired_reads.fastq]" << endl << endl
          << "  --all-to-stdout" << endl
          << "       Write all reads to stdout, ignoring pairing" << endl << endl
+         << "  --stdout-queue N" << endl
+         << "       With --pairs-to-stdout or --all-to-stdout, let up to N --write-buffer" << endl
+         << "       sized buffers wait for a thread of their own to write them, so a slow" << endl
+         << "       reader on the other end of the pipe holds things up as little as" << endl
+         << "       possible.  0 writes them as they fill up.  [Default: 4]" << endl << endl
+         << "  --collated" << endl
+         << "  --no-collated" << endl
+         << "       The two reads of each pair are (are not) next to each other in the BAM," << endl
+         << "       so they can be paired without holding on to any other reads." << endl
+         << "       [Default: collated if the header says SO:queryname]" << endl << endl
+         << "  --region REGION" << endl
+         << "       Only extract reads overlapping REGION (chr, chr:start or chr:start-end)." << endl
+         << "       May be given more than once.  Needs a .bai index for the BAM file." << endl << endl
+         << "  --by-contig" << endl
+         << "       Read an indexed BAM file with --threads readers at once, each taking" << endl
+         << "       its own set of contigs.  Reads are not written in the BAM's order." << endl << endl
+         << "  --by-offset" << endl
+         << "       Like --by-contig, but split the file into --threads stretches of" << endl
+         << "       about the same size instead, so no index is needed.  Doesn't work" << endl
+         << "       on pipes.  Reads are not written in the BAM's order." << endl << endl
+         << "  --parallel-inputs" << endl
+         << "       With several BAM files, read all of them at once on threads of their" << endl
+         << "       own.  Reads are not written in the BAMs' order." << endl << endl
+         << "  --reference FASTA" << endl
+         << "       Decode CRAM input against FASTA.  Without it, samtools finds the" << endl
+         << "       reference through REF_PATH, and REF_CACHE lets all the jobs on a" << endl
+         << "       machine share one downloaded copy." << endl << endl
+         << "  --samtools PATH" << endl
+         << "       Run PATH to decode CRAM input, which it does on --threads threads." << endl
+         << "       It needs to be samtools 1.0 or later.  [Default: samtools]" << endl << endl
+         << "  --quality-offset N" << endl
+         << "       Write qualities as Phred+N, e.g. 64 for older Illumina tools [Default: 33]" << endl << endl
+         << "  --name-suffix mate|none|casava" << endl
+         << "       End the names of paired reads with /1 or /2 (mate), with nothing, or" << endl
+         << "       give every read a Casava 1.8 style comment like \" 1:N:0:ACGT\", with" << endl
+         << "       the read number, Y for reads failing QC and the BC tag's barcode." << endl
+         << "       Except with mate, a /1 or /2 already in a name is dropped, unless" << endl
+         << "       --strict.  [Default: mate]" << endl << endl
+         << "  --tags TAG,TAG..." << endl
+         << "       Copy these tags of each read, such as BC or RX, into its comment" << endl
+         << "       after a tab each, the way they'd look in SAM (BC:Z:ACGT)" << endl << endl
+         << "  --use-oq" << endl
+         << "       Write the original qualities from the OQ tag, for reads that have" << endl
+         << "       it, instead of the recalibrated ones" << endl << endl
+         << "  --index-reads" << endl
+         << "       Write the barcode of each pair (its BC tag, with the qualities from" << endl
+         << "       QT) as a read of its own to an _I1 file alongside _1 and _2.  Not" << endl
+         << "       with --pairs-to-stdout or --all-to-stdout." << endl << endl
          << "  -f, --force, --overwrite" << endl
          << "       Create output files specified with --output, overwriting existing" << endl
          << "       files if necessary [Default: exit program rather than overwrite files]" << endl << endl
@@ -92,101 +297,172 @@ void usage(int error=1) {
          << "  --no-filtered" << endl
          << "       Reads that are marked as failing QC checks will (will not) be extracted." << endl
          << "       [Default: extract filtered reads]" << endl << endl
+         << "  --secondary" << endl
+         << "  --no-secondary" << endl
+         << "       Secondary and supplementary alignments will (will not) be extracted" << endl
+         << "       along with everything else.  They repeat reads that are already in" << endl
+         << "       the BAM file.  [Default: skip them]" << endl << endl
+         << "  --secondary-output FILE" << endl
+         << "       Write secondary and supplementary alignments to FILE, unpaired," << endl
+         << "       instead of skipping them" << endl << endl
+         << "  --require-flags FLAGS" << endl
+         << "  --exclude-flags FLAGS" << endl
+         << "       Only extract reads with all of (none of) the FLAGS set, like samtools" << endl
+         << "       view -f and -F.  FLAGS is a number, e.g. 4 or 0x900." << endl << endl
          << "  -q, --quiet" << endl
          << "       Suppress informational messages [Default: print messages]" << endl << endl
          << "  -s, --strict" << endl
          << "       Keep bam2fastq's processing to a minimum, assuming that the BAM strictly"
          << "       meets specifications. [Default: allow some errors in the BAM]" << endl << endl
+         << "  -t N, --threads N" << endl
+         << "       Use N threads each for decompressing the BAM file and formatting" << endl
+         << "       the FASTQ records, plus one for writing them out [Default: 1, or" << endl
+         << "       half the CPUs given by --cpus or --numa-node]" << endl << endl
+         << "  --cpus LIST" << endl
+         << "       Pin each thread to a CPU of its own from LIST, e.g. 0-7,16-23, in the" << endl
+         << "       order they start, so that each stage's threads are next to each" << endl
+         << "       other.  Threads beyond the number of CPUs may run on any of them." << endl << endl
+         << "  --numa-node N" << endl
+         << "       Run on the CPUs of NUMA node N (those of them in --cpus, if it's" << endl
+         << "       given too), and allocate memory there where possible" << endl << endl
+         << "  --max-memory SIZE" << endl
+         << "       Keep at most SIZE bytes (K, M and G suffixes are allowed) of reads" << endl
+         << "       waiting for their mates in memory, and move the oldest of them to" << endl
+         << "       temporary files in $TMPDIR beyond that [Default: no limit]" << endl << endl
+         << "  --stats[=json]" << endl
+         << "       When done, report the time spent reading, formatting, pairing," << endl
+         << "       compressing and writing, how fast the reads went, how many bytes went" << endl
+         << "       in and out, and the most reads held at once waiting for their mates" << endl
+         << "       on stderr.  As a single line of JSON with --stats=json." << endl << endl
+         << "  --progress[=SECONDS]" << endl
+         << "       Report how many reads have been exported so far on stderr every" << endl
+         << "       SECONDS seconds [Default: 10]" << endl << endl
+         << "  --checkpoint FILE" << endl
+         << "       Every --checkpoint-interval seconds, sync the output files and save" << endl
+         << "       how far through the BAM file we are, and the reads waiting for their" << endl
+         << "       mates, in FILE.  It's deleted once the whole BAM has been converted." << endl
+         << "       Needs a single BAM file (not stdin or CRAM) and output files, and" << endl
+         << "       doesn't go with --max-memory, --region, --by-contig or --by-offset." << endl << endl
+         << "  --checkpoint-interval SECONDS" << endl
+         << "       How often to save a checkpoint [Default: 300]" << endl << endl
+         << "  --resume" << endl
+         << "       If the --checkpoint FILE is there, cut the outputs back to where it" << endl
+         << "       was saved and carry on from there, rather than starting again" << endl << endl
+         << "  --mmap" << endl
+         << "       Map the BAM file into memory and decompress it from there, rather than" << endl
+         << "       reading it.  Best for files on fast local disks." << endl << endl
+         << "  --write-buffer SIZE" << endl
+         << "       Collect SIZE bytes of FASTQ for each output before writing it out," << endl
+         << "       which suits network filesystems [Default: 8M]" << endl << endl
+         << "  --compress gz|bgzf" << endl
+         << "       Compress the output, adding .gz to the file names.  bgzf output can" << endl
+         << "       also be read by anything that reads gzip, and can be indexed." << endl
+         << "       [Default: plain text]" << endl << endl
+         << "  --compress-level N" << endl
+         << "       zlib compression level, from 0 (none) to 9 (best) [Default: 6]" << endl << endl
+         << "  --compress-threads N" << endl
+         << "       Compress on N threads [Default: the same as --threads]" << endl << endl
          << endl;
     exit(error);
 }
 
-map<int, char> bases;
-
-const string get_pair_name(const bam1_t *b) {
-    return string(bam1_qname(b));
-}
-
 //Returns 0 for read 1 and 1 for read 2.
 //Counterintuitive, but good for lookups
 const int get_read_idx(const bam1_t *b) {
     return !(b->core.flag & BAM_FREAD1);
 }
 
-const string get_read_name(const bam1_t *b) {
-    static const char suffix[2][3] = { "/1", "/2" };
-    string name = get_pair_name(b);
-    if (b->core.flag & BAM_FPAIRED)
-        name += suffix[get_read_idx(b)];
-    return name;
-}
+//Effective STL, Item 7
+//Except, of course, that I'm not using smart pointers
+struct DeleteObject {
+    template<typename T>
+    void operator()(const T *ptr) const {
+        delete ptr;
+    }
+};
 
-int get_lane_id(const bam1_t *b) {
-    string name(get_pair_name(b));
-    size_t start = name.find(":");
-    if (start == string::npos)
-        return 0;
-    start++;
-    size_t stop = name.find(":", start);
-    if (stop == string::npos || stop == start)
-        return 0;
-    istringstream ist(string(name.begin()+start, name.begin()+stop));
-    int lane;
-    ist >> lane;
-    return lane;
+//Compressed files get .gz on the end, unless the name already has it
+string compressed_name(const string &name) {
+    if (compressor == NULL || (name.size() >= 3 && name.compare(name.size() - 3, 3, ".gz") == 0))
+        return name;
+    return name + ".gz";
 }
 
-const string get_sequence(const bam1_t *b) {
-    const uint8_t *seq = bam1_seq(b);
-    size_t len = b->core.l_qseq;
-    string sequence("");
-    sequence.reserve(len);
-    uint8_t offset = (b->core.flag & BAM_FREVERSE) ? 16 : 0;
-    for (size_t i=0; i<len; i++) {
-        sequence += bases[bam1_seqi(seq, i) + offset];
-    }
-    if (offset)
-        sequence = string(sequence.rbegin(), sequence.rend());
-    return sequence;
+vector<OutputBuffer *> initialize_all_stdout() {
+    vector<OutputBuffer *> files;
+    files.push_back(new OutputBuffer(STDOUT_FILENO, false, write_buffer, compressor,
+                                     stdout_queue));
+    return files;
 }
 
-const string get_qualities(const bam1_t *b) {
-    const uint8_t *qual = bam1_qual(b);
-    size_t len = b->core.l_qseq;
-    string quality("");
-    quality.reserve(len);
-    for (size_t i=0; i<len; i++) {
-        quality += char_traits<char>::to_char_type(char_traits<char>::to_int_type(qual[i])+33);
-    }
-    if (b->core.flag & BAM_FREVERSE)
-        quality = string(quality.rbegin(), quality.rend());
-    return quality;
+//Both reads of a pair share one buffer, so they stay interleaved
+vector<OutputBuffer *> initialize_paired_stdout() {
+    vector<OutputBuffer *> files;
+    //Whoever reads a FIFO may only get to it after reading stdout, so it
+    //gets a queue too
+    OutputBuffer *unpaired = OutputBuffer::create(compressed_name(unpaired_path), write_buffer,
+                                                  compressor, false, stdout_queue);
+    if (unpaired == NULL)
+        return files;
+    files.push_back(new OutputBuffer(STDOUT_FILENO, false, write_buffer, compressor,
+                                     stdout_queue));
+    files.push_back(files.back());
+    files.push_back(unpaired);
+    return files;
 }
 
-void mangle(string &name) {
-    if (name.length() < 3)
-        return;
-    if (isdigit(name[name.length()-1]) && !isdigit(name[name.length()-2]))
-        name.erase(name.length()-2);
-}
+//Marks the read group and the chunk in an --output template
+const char read_group_marker[] = "{rg}";
+const char chunk_marker[] = "{chunk}";
 
-vector<ostream *> initialize_all_stdout() {
-    vector<ostream *> files;
-    files.push_back(&std::cout);
-    return files;
+//Stands in for {rg} with reads that have no RG tag.  read_group_name never
+//puts out a % that isn't followed by two hex digits, so no ID can clash with it.
+const char no_read_group_name[] = "%none";
+
+//An RG ID as it goes into a filename.  IDs may contain anything printable,
+//so everything but letters, digits and -_.+ is written as %XX, along with a
+//leading dot; that keeps / and .. from leaving the directory, and the markers
+//(%, #, {chunk}) from being substituted a second time.  Distinct IDs stay
+//distinct.
+string read_group_name(const string &id) {
+    static const char hex[] = "0123456789ABCDEF";
+    string name;
+    for (size_t i = 0; i < id.size(); i++) {
+        unsigned char c = id[i];
+        if (isalnum(c) || c == '-' || c == '_' || c == '+' || (c == '.' && i > 0)) {
+            name += c;
+        } else {
+            name += '%';
+            name += hex[c >> 4];
+            name += hex[c & 15];
+        }
+    }
+    return name;
 }
 
-vector<ostream *> initialize_paired_stdout() {
-    vector<ostream *> files;
-    files.push_back(&std::cout);
-    files.push_back(&std::cout);
-    files.push_back(new ofstream("unpaired_reads.fastq", ios_base::out));
-    return files;
+//With reopen, appends to the file we created earlier on
+OutputBuffer *initialize_secondary(const string &path, bool reopen = false) {
+    string name = compressed_name(path);
+    if (print_msgs)
+        cerr << "Secondary and supplementary alignments will be in " << name << endl;
+    if (!overwrite_files && !reopen) {
+        ifstream test(name.c_str());
+        if (test.is_open()) {
+            cerr << "ERROR: " << name << " already exists.  Specify --force to overwrite" << endl;
+            return NULL;
+        }
+    }
+    return OutputBuffer::create(name, write_buffer, compressor, reopen);
 }
 
-vector<ostream *> initialize_output(const string &out_template, int lane) {
+//With reopen, the files are appended to without any checks, because we
+//created them earlier on.  chunk is counted from 1, when the template has
+//{chunk} in it.
+vector<OutputBuffer *> initialize_output(const string &out_template, int lane,
+                                         const string &read_group, bool reopen = false,
+                                         size_t chunk = 0) {
     
-    vector<ostream *> files;
+    vector<OutputBuffer *> files;
     string output(out_template);
     
     //First, replace % in the filename with the lane number
@@ -201,6 +477,16 @@ vector<ostream *> initialize_output(const string &out_template, int lane) {
         laneStr << lane;
         output.replace(laneMarker, 1, laneStr.str());
     }
+    size_t groupMarker = output.find(read_group_marker);
+    if (groupMarker != string::npos)
+        output.replace(groupMarker, strlen(read_group_marker), read_group);
+    size_t chunkMarker = output.find(chunk_marker);
+    if (chunkMarker != string::npos) {
+        ostringstream chunkStr;
+        chunkStr << setw(4) << setfill('0') << chunk;
+        output.replace(chunkMarker, strlen(chunk_marker), chunkStr.str());
+    }
+    output = compressed_name(output);
     
     //Replace # with read number and open ofstreams
     size_t readMarker = output.find('#');
@@ -218,15 +504,22 @@ vector<ostream *> initialize_output(const string &out_template, int lane) {
     file2.replace(readMarker, 1, "_2");
     string file3(output);
     file3.replace(readMarker, 1, "_M");
+    string file4(output);
+    file4.replace(readMarker, 1, "_I1");
 
-    if (print_msgs) {
+    //Once is enough for the chunks
+    if (print_msgs && !reopen && chunk <= 1) {
         cerr << "This looks like paired data from lane " << lane << "." << endl
              << "Output will be in " << file1 << " and " << file2 << endl
              << "Single-end reads will be in " << file3 << endl;
+        if (fastq_format.index_reads)
+            cerr << "Index reads will be in " << file4 << endl;
+        if (chunk == 1)
+            cerr << "Each chunk after the first will be numbered one more" << endl;
     }
 
     //If we're not going to overwrite, check to see if the files exist
-    if (!overwrite_files) {
+    if (!overwrite_files && !reopen) {
         ifstream test;
         test.open(file1.c_str());
         if (test.is_open()) {
@@ -241,86 +534,586 @@ vector<ostream *> initialize_output(const string &out_template, int lane) {
         }
     }
 
-    files.push_back(new ofstream(file1.c_str(), ios_base::out));
-    files.push_back(new ofstream(file2.c_str(), ios_base::out));
-    files.push_back(new ofstream(file3.c_str(), ios_base::out));
+    const string *names[] = { &file1, &file2, &file3, &file4 };
+    for (size_t i = 0; i < (fastq_format.index_reads ? 4 : 3); i++) {
+        OutputBuffer *file = OutputBuffer::create(*names[i], write_buffer, compressor, reopen);
+        if (file == NULL) {
+            for_each(files.begin(), files.end(), DeleteObject());
+            files.clear();
+            break;
+        }
+        files.push_back(file);
+    }
 
     return files;
 }
 
-//Effective STL, Item 7
-//Except, of course, that I'm not using smart pointers
-struct DeleteObject {
-    template<typename T>
-    void operator()(const T *ptr) const {
-        delete ptr;
+//Deletes a set of outputs.  With --pairs-to-stdout the first two are the
+//same one.
+void close_output(vector<OutputBuffer *> &files) {
+    for (size_t i = 0; i < files.size(); i++) {
+        if (i == 0 || files[i] != files[i-1])
+            delete files[i];
+    }
+    files.clear();
+}
+
+//Identifies the lane and read group of a set of split output files.
+//Whichever of them isn't in the template is left at 0.
+struct OutputKey {
+    OutputKey() : lane(0), group(0) {}
+    bool operator==(const OutputKey &k) const { return lane == k.lane && group == k.group; }
+    bool operator<(const OutputKey &k) const {
+        return lane < k.lane || (lane == k.lane && group < k.group);
     }
+    int lane;
+    //A ReadGroups number, or -1 for reads without an RG tag
+    int group;
 };
 
-void parse_bamfile(const char *bam_filename, const string &output_template) {
-    samfile_t *sam = samopen(bam_filename, "rb", NULL);
-    if (sam == NULL) {
-        cerr << "Could not open " << bam_filename << endl;
-        return;
+//Where each read goes.  Usually that's one set of files for everything,
+//but when the --output template has % or {rg} in it, each lane or read
+//group gets its own, opened when the first of its reads turns up.  Only
+//max_open of those are kept open at once; the least recently used are
+//closed, to be appended to if they're needed again.  With {chunk}, each
+//set is closed for good once it's full and the next chunk's started.
+class OutputFiles {
+public:
+    explicit OutputFiles(const vector<OutputBuffer *> &files)
+        : m_fixed(files), m_by_lane(false), m_by_group(false), m_chunked(false),
+          m_lane(0), m_groups(NULL), m_max_open(0), m_open(0), m_clock(0), m_last(NULL) {}
+
+    //lane is what the files are named after when the template has no %
+    OutputFiles(const string &out_template, ReadGroups &groups, size_t max_open, int lane = 0)
+        : m_template(out_template), m_lane(lane), m_groups(&groups), m_max_open(max_open),
+          m_open(0), m_clock(0), m_last(NULL) {
+        m_by_lane = out_template.find('%') != string::npos;
+        m_by_group = out_template.find(read_group_marker) != string::npos;
+        m_chunked = out_template.find(chunk_marker) != string::npos;
     }
-    bam1_t *read = bam_init1();
-    size_t exported = 0;
-    size_t all_seen = 0;
 
-    bam_read1(sam->x.bam, read);
-    int lane = get_lane_id(read);
+    ~OutputFiles() {
+        close_output(m_fixed);
+        for (map<OutputKey, Group>::iterator i = m_sets.begin(); i != m_sets.end(); ++i) {
+            if (m_chunked)
+                next_chunk(i->second);
+            else
+                close_output(i->second.files);
+        }
+    }
 
-    vector<ostream *> output;
-    if(stdout_pairs) {
-        output = initialize_paired_stdout();
-    } else if(stdout_all) {
-        output = initialize_all_stdout();
-    } else {
-        output = initialize_output(output_template, lane);
+    bool split() const { return m_by_lane || m_by_group || m_chunked; }
+
+    //Syncs every open file, and adds all the files and sets of split
+    //files created so far to checkpoint.  False if a file couldn't be
+    //synced.
+    bool save(Checkpoint &checkpoint) {
+        vector<string> paths;
+        bool ok = true;
+        for (size_t i = 0; i < m_fixed.size(); i++) {
+            ok = m_fixed[i]->sync() && ok;
+            paths.push_back(m_fixed[i]->path());
+        }
+        for (map<OutputKey, Group>::iterator i = m_sets.begin(); i != m_sets.end(); ++i) {
+            Group &g = i->second;
+            for (size_t j = 0; j < g.files.size(); j++)
+                ok = g.files[j]->sync() && ok;
+            if (g.created) {
+                paths.insert(paths.end(), g.paths.begin(), g.paths.end());
+                Checkpoint::OutputSet set;
+                set.lane = i->first.lane;
+                set.group = i->first.group;
+                set.group_id = group_id(i->first);
+                set.chunk = g.chunk;
+                set.reads = g.reads + reads(g.files);
+                set.bytes = g.bytes + bytes(g.files);
+                checkpoint.groups.push_back(set);
+            }
+        }
+        for (size_t i = 0; i < paths.size() && ok; i++) {
+            struct stat st;
+            ok = stat(paths[i].c_str(), &st) == 0;
+            if (ok)
+                checkpoint.files.push_back(make_pair(paths[i], (uint64_t)st.st_size));
+        }
+        return ok;
+    }
+
+    //What a checkpoint needs to find key's read group again, which is
+    //its ID: the number may be different next time
+    string group_id(const OutputKey &key) const {
+        return m_by_group && key.group >= 0 ? m_groups->id(key.group) : "";
+    }
+
+    //The key a checkpoint saved with group_id(), in this run's numbers
+    OutputKey saved_key(int lane, int group, const string &id) const {
+        OutputKey k;
+        k.lane = lane;
+        k.group = m_by_group && group >= 0 ? m_groups->group(id) : group;
+        return k;
+    }
+
+    //The sets of split files in checkpoint are there already, so they're
+    //appended to
+    void restore(const Checkpoint &checkpoint) {
+        for (size_t i = 0; i < checkpoint.groups.size(); i++) {
+            const Checkpoint::OutputSet &set = checkpoint.groups[i];
+            Group &g = m_sets[saved_key(set.lane, set.group, set.group_id)];
+            g.created = true;
+            g.chunk = set.chunk;
+            g.reads = set.reads;
+            g.bytes = set.bytes;
+        }
+    }
+    //Reads waiting for their mates have to keep their RG tags, which
+    //the lane may come from too
+    bool needs_tags() const { return m_by_lane || m_by_group; }
+
+    //Which set of files read goes in; empty if they couldn't be opened
+    const vector<OutputBuffer *> &get(const bam1_t *read) {
+        if (!split())
+            return m_fixed;
+        return get(key(read));
+    }
+
+    const vector<OutputBuffer *> &get(const OutputKey &key) {
+        if (!split())
+            return m_fixed;
+        //Runs of reads from the same lane are the usual case
+        Group &g = m_last && m_last_key == key ? *m_last : m_sets[key];
+        m_last = &g;
+        m_last_key = key;
+        g.last_used = ++m_clock;
+        //Checked before each read goes in, so a pair is never split up
+        if (m_chunked && (g.chunk == 0 || full(g)))
+            next_chunk(g);
+        if (!g.files.empty() || g.failed)
+            return g.files;
+        if (m_open >= m_max_open)
+            close_oldest();
+        string read_group = key.group < 0 ? string(no_read_group_name)
+                                           : read_group_name(m_groups->id(key.group));
+        g.files = initialize_output(m_template, key.lane, read_group, g.created, g.chunk);
+        g.failed = g.files.empty();
+        g.created = true;
+        g.paths.clear();
+        for (size_t i = 0; i < g.files.size(); i++)
+            g.paths.push_back(g.files[i]->path());
+        if (!g.failed)
+            m_open++;
+        return g.files;
+    }
+
+    OutputKey key(const bam1_t *read) const {
+        OutputKey k;
+        k.lane = m_by_lane ? m_groups->lane(read) : m_lane;
+        if (m_by_group)
+            k.group = m_groups->group(read);
+        return k;
     }
 
+private:
+    struct Group {
+        Group() : created(false), failed(false), last_used(0), chunk(0), reads(0), bytes(0) {}
+        vector<OutputBuffer *> files;
+        //Of the files, even while they're closed
+        vector<string> paths;
+        bool created;
+        bool failed;
+        size_t last_used;
+        //With {chunk}, the one the files are for, and the reads and bytes
+        //that went into it while it was open earlier on
+        size_t chunk;
+        uint64_t reads;
+        uint64_t bytes;
+    };
+
+    OutputFiles(const OutputFiles &);
+    OutputFiles &operator=(const OutputFiles &);
+
+    //Pairs and single-end reads, going by the _1 and _M files
+    static uint64_t reads(const vector<OutputBuffer *> &files) {
+        return files.size() >= 3 ? files[0]->writes() + files[2]->writes() : 0;
+    }
+    static uint64_t bytes(const vector<OutputBuffer *> &files) {
+        uint64_t total = 0;
+        for (size_t i = 0; i < files.size(); i++)
+            total += files[i]->bytes();
+        return total;
+    }
+
+    bool full(const Group &g) const {
+        return (split_reads > 0 && g.reads + reads(g.files) >= split_reads) ||
+               (split_bytes > 0 && g.bytes + bytes(g.files) >= split_bytes);
+    }
+
+    void close(Group &g) {
+        g.reads += reads(g.files);
+        g.bytes += bytes(g.files);
+        close_output(g.files);
+        m_open--;
+    }
+
+    //Finishes off the group's chunk, if it has one, so that the next
+    //get() opens the one after it
+    void next_chunk(Group &g) {
+        if (!g.files.empty())
+            close(g);
+        if (g.created && print_msgs) {
+            cerr << "Finished chunk " << g.chunk << ":";
+            for (size_t i = 0; i < g.paths.size(); i++)
+                cerr << " " << g.paths[i];
+            cerr << endl;
+        }
+        g.chunk++;
+        g.created = false;
+        g.reads = 0;
+        g.bytes = 0;
+    }
+
+    void close_oldest() {
+        Group *oldest = NULL;
+        for (map<OutputKey, Group>::iterator i = m_sets.begin(); i != m_sets.end(); ++i) {
+            Group &g = i->second;
+            if (!g.files.empty() && (oldest == NULL || g.last_used < oldest->last_used))
+                oldest = &g;
+        }
+        if (oldest)
+            close(*oldest);
+    }
+
+    vector<OutputBuffer *> m_fixed;
+    string m_template;
+    bool m_by_lane;
+    bool m_by_group;
+    bool m_chunked;
+    int m_lane;
+    ReadGroups *m_groups;
+    size_t m_max_open;
+    map<OutputKey, Group> m_sets;
+    size_t m_open;
+    size_t m_clock;
+    Group *m_last;
+    OutputKey m_last_key;
+};
+
+//Reads are formatted in batches, so the formatting can happen on worker
+//threads while the batches are written out in their original order
+const size_t batch_size = 4096;
+
+struct ReadBatch {
+    ReadBatch() : count(0), positioned(false), next_block(0), next_offset(0), exported(0),
+                  skipped(0) {}
+    ~ReadBatch() {
+        for (size_t i = 0; i < reads.size(); i++)
+            bam_destroy1(reads[i]);
+    }
+
+    bam1_t *&slot(size_t i) {
+        while (reads.size() <= i)
+            reads.push_back(bam_init1());
+        return reads[i];
+    }
+
+    void run() {
+        StageTimer timer(Stats::FORMAT);
+        if (strict)
+            format<true>();
+        else
+            format<false>();
+    }
+
+    //The text buffer only ever grows, so once it's big enough formatting
+    //doesn't allocate at all
+    template<bool strict_names>
+    void format() {
+        ends.resize(count);
+        name_lengths.resize(count);
+        key_lengths.resize(count);
+        hashes.resize(count);
+        tags.resize(count);
+        size_t length = 0;
+        size_t index_text_length = 0;
+        for (size_t i = 0; i < count; i++) {
+            const char *name = bam1_qname(reads[i]);
+            name_lengths[i] = strlen(name);
+            find_tags(reads[i], fastq_format, tags[i]);
+            if (reads[i]->core.flag & BAM_FPAIRED) {
+                key_lengths[i] = pair_key_length<strict_names>(name, name_lengths[i]);
+                if (!collated)
+                    hashes[i] = PairTable::hash(name, key_lengths[i]);
+                if (fastq_format.suffix != SUFFIX_MATE)
+                    name_lengths[i] = key_lengths[i];
+                if (fastq_format.index_reads)
+                    index_text_length += index_length(reads[i], key_lengths[i], fastq_format,
+                                                      tags[i]);
+            }
+            length += fastq_length(reads[i], name_lengths[i], fastq_format, tags[i]);
+        }
+        if (text.size() < length)
+            text.resize(length);
+        char *end = text.empty() ? NULL : &text[0];
+        for (size_t i = 0; i < count; i++) {
+            end = format_fastq(reads[i], name_lengths[i], fastq_format, tags[i], end);
+            ends[i] = end - &text[0];
+        }
+        if (fastq_format.index_reads)
+            format_index_reads(index_text_length);
+    }
+
+    //Only the paired reads have index reads; for the others the range
+    //is empty.  They're named by the pair name, the same for both reads.
+    void format_index_reads(size_t length) {
+        index_ends.resize(count);
+        if (index_text.size() < length)
+            index_text.resize(length);
+        char *end = index_text.empty() ? NULL : &index_text[0];
+        for (size_t i = 0; i < count; i++) {
+            if (reads[i]->core.flag & BAM_FPAIRED)
+                end = format_index(reads[i], key_lengths[i], fastq_format, tags[i], end);
+            index_ends[i] = end - (index_text.empty() ? NULL : &index_text[0]);
+        }
+    }
+
+    vector<bam1_t *> reads;
+    size_t count;
+    //With --checkpoint: where the record after these starts, if the
+    //input could say, and the totals so far up to there
+    bool positioned;
+    uint64_t next_block;
+    size_t next_offset;
+    size_t exported;
+    size_t skipped;
+    //The text of read i is [ends[i-1], ends[i])
+    vector<char> text;
+    vector<size_t> ends;
+    //How much of each name goes in its record
+    vector<size_t> name_lengths;
+    vector<RecordTags> tags;
+    //Laid out like text, with --index-reads
+    vector<char> index_text;
+    vector<size_t> index_ends;
+    //Only filled in for paired reads, and no hashes when collated
+    vector<size_t> key_lengths;
+    vector<uint64_t> hashes;
+};
+
+//Moves records into batch until it's full or the input runs out.  read
+//holds the next record on the way in and out; more is false at the end.
+//The input has already passed over the reads we aren't extracting.
+void fill_batch(BamInput *input, bam1_t *&read, bool &more, ReadBatch *batch,
+                size_t &exported) {
+    StageTimer timer(Stats::READ);
+    batch->count = 0;
+    size_t bytes = 0;
+    //Swap the records into the batch rather than copy them
+    while (more && batch->count < batch_size) {
+        exported++;
+        swap(read, batch->slot(batch->count));
+        batch->count++;
+        //What read() passes over on the way to the next record comes
+        //after the position, so it isn't counted yet either
+        if (checkpoint_path) {
+            batch->positioned = input->position(batch->next_block, batch->next_offset);
+            batch->skipped = input->skipped();
+        }
+        int n = input->read(read);
+        more = n > 0;
+        if (more)
+            bytes += n;
+    }
+    batch->positioned = batch->positioned && more;
+    batch->exported = exported;
+    if (Stats::current)
+        Stats::current->add_input_bytes(bytes);
+}
+
+//--aligned, --unaligned and --filtered are just particular flag filters
+void apply_flag_filter(BamInput *input) {
+    int require = require_flags;
+    int exclude = exclude_flags;
+    if (!save_aligned)
+        require |= BAM_FUNMAP;
+    if (!save_unaligned)
+        exclude |= BAM_FUNMAP;
+    if (!save_filtered)
+        exclude |= BAM_FQCFAIL;
+    if (!save_secondary && secondary_path == NULL)
+        exclude |= BAM_FSECONDARY | BAM_FSUPPLEMENTARY;
+    input->set_flag_filter(require, exclude);
+}
+
+//Reads waiting for their mates.  When the input is collated, that's only
+//ever the one read before this one; otherwise they live in the table.
+struct Mates {
+    Mates(size_t chunk_bytes, bool keep_tags)
+        : table(chunk_bytes, keep_tags), spill(NULL), waiting(false), waiting_idx(0) {}
+    ~Mates() { delete spill; }
+
+    PairTable table;
+    PairSpill *spill;
+
+    bool waiting;
+    int waiting_idx;
+    string waiting_key;
+    string waiting_text;
+    //OutputFiles::key of the waiting read, when the output is split
+    OutputKey waiting_output;
+};
+
+//All of the name, unless a suffix other than /1 or /2 is taking the
+//place of one that's part of it
+size_t written_name_length(const bam1_t *read) {
+    if (fastq_format.suffix == SUFFIX_MATE || !(read->core.flag & BAM_FPAIRED))
+        return strlen(bam1_qname(read));
+    return strict ? pair_key_length<true>(read) : pair_key_length<false>(read);
+}
+
+void write_read(const bam1_t *read, OutputBuffer &out) {
+    size_t name_length = written_name_length(read);
+    RecordTags tags;
+    find_tags(read, fastq_format, tags);
+    size_t length = fastq_length(read, name_length, fastq_format, tags);
+    format_fastq(read, name_length, fastq_format, tags, out.reserve(length));
+    out.commit(length);
+}
+
+//The index read of a pair, when the output has a file for them
+void write_index(const bam1_t *read, const vector<OutputBuffer *> &output) {
+    if (output.size() <= 3)
+        return;
+    size_t name_length = strict ? pair_key_length<true>(read) : pair_key_length<false>(read);
+    RecordTags tags;
+    find_tags(read, fastq_format, tags);
+    size_t length = index_length(read, name_length, fastq_format, tags);
+    format_index(read, name_length, fastq_format, tags, output[3]->reserve(length));
+    output[3]->commit(length);
+}
+
+//Writes a matched pair, read 1 to output[0] and read 2 to output[1]
+void write_pair(const bam1_t *read, const bam1_t *mate, const vector<OutputBuffer *> &output) {
     if (output.empty())
         return;
+    if (get_read_idx(read) == 0) {
+        write_read(read, *output[0]);
+        write_read(mate, *output[1]);
+    } else {
+        write_read(mate, *output[0]);
+        write_read(read, *output[1]);
+    }
+    write_index(read, output);
+}
 
-    map<string, string> unPaired;
-    map<string, string>::iterator position;
+//A read that never found its mate goes to the _M file
+void write_unpaired(const bam1_t *read, OutputFiles &files) {
+    const vector<OutputBuffer *> &output = files.get(read);
+    if (!output.empty())
+        write_read(read, *output[2]);
+    if (Stats::current)
+        Stats::current->add_orphans(1);
+}
 
-    do {
-        all_seen++;
-        if (!save_aligned && !(read->core.flag & BAM_FUNMAP))
-            continue;
-        if (!save_unaligned && (read->core.flag & BAM_FUNMAP))
+//Partitions for --max-memory.  Each holds about 1/64th of the spilled
+//reads, which is what has to fit in memory when we match them up.
+const size_t spill_partitions = 64;
+
+//Mates of collated reads are right next to each other, so either the
+//read we're holding is this one's mate or it never had one.  output is
+//where this read goes.  Returns true if that made a pair.
+bool collate_read(const bam1_t *read, const char *key, size_t key_length,
+                  const char *text, size_t length,
+                  const vector<OutputBuffer *> &output, OutputFiles &files, Mates &mates) {
+    int r_idx = get_read_idx(read);
+    if (mates.waiting && mates.waiting_idx != r_idx &&
+            mates.waiting_key.compare(0, string::npos, key, key_length) == 0) {
+        //Read 1 first, for the sake of interleaved stdout
+        if (r_idx == 0) {
+            output[0]->write(text, length);
+            output[1]->write(mates.waiting_text.data(), mates.waiting_text.size());
+        } else {
+            output[0]->write(mates.waiting_text.data(), mates.waiting_text.size());
+            output[1]->write(text, length);
+        }
+        mates.waiting = false;
+        return true;
+    }
+    if (mates.waiting) {
+        const vector<OutputBuffer *> &waiting_output = files.get(mates.waiting_output);
+        if (!waiting_output.empty())
+            waiting_output[2]->write(mates.waiting_text.data(), mates.waiting_text.size());
+        if (Stats::current)
+            Stats::current->add_orphans(1);
+    }
+    if (files.split())
+        mates.waiting_output = files.key(read);
+    mates.waiting = true;
+    mates.waiting_idx = r_idx;
+    mates.waiting_key.assign(key, key_length);
+    mates.waiting_text.assign(text, length);
+    return false;
+}
+
+//The index read the batch has for read i, when the output has a file for
+//them
+void write_batch_index(const ReadBatch &batch, size_t i, const vector<OutputBuffer *> &output) {
+    if (output.size() <= 3)
+        return;
+    size_t begin = i > 0 ? batch.index_ends[i-1] : 0;
+    output[3]->write(&batch.index_text[0] + begin, batch.index_ends[i] - begin);
+}
+
+void write_batch(const ReadBatch &batch, OutputFiles &files, Mates &mates) {
+    StageTimer timer(Stats::PAIR);
+    PairTable &unPaired = mates.table;
+    bam1_t mate;
+    size_t begin = 0;
+
+    //Everything going to the one file is the easy case: the batch is
+    //already formatted in order
+    if (batch.count > 0 && !files.split() && files.get(batch.reads[0]).size() == 1 &&
+            secondary_output == NULL) {
+        files.get(batch.reads[0])[0]->write(&batch.text[0], batch.ends[batch.count - 1]);
+        return;
+    }
+
+    for (size_t i = 0; i < batch.count; i++) {
+        const bam1_t *read = batch.reads[i];
+        const char *text = &batch.text[0] + begin;
+        size_t length = batch.ends[i] - begin;
+        begin = batch.ends[i];
+        //These never take part in pairing
+        if (secondary_output && (read->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY))) {
+            secondary_output->write(text, length);
             continue;
-        if (!save_filtered && (read->core.flag & BAM_FQCFAIL))
+        }
+        const vector<OutputBuffer *> &output = files.get(read);
+        if (output.empty())
             continue;
 
-        exported++;
-        ostringstream ostr;
-        ostr << "@" << get_read_name(read) << endl
-             << get_sequence(read) << endl
-             << "+" << endl
-             << get_qualities(read) << endl;
-
         //Paired-end is complicated, because both members of the pair
         //have to be output at the same position of the two files
 
         // If there is only one output filehandle we don't care about
         // pairing and can write immediately
         if(output.size() == 1) {
-            *output[0] << ostr.str();
+            output[0]->write(text, length);
         } else if( !(read->core.flag & BAM_FPAIRED) ) {
             // Is this an unpaired read in a BAM with pairs? write to the _M file
-            *output[2] << ostr.str();
+            output[2]->write(text, length);
+        } else if (collated) {
+            if (collate_read(read, bam1_qname(read), batch.key_lengths[i], text, length,
+                             output, files, mates))
+                write_batch_index(batch, i, output);
         } else {
 
-            // Search for the pair in the map
-            string pairName(get_pair_name(read));
-            if (!strict)
-                mangle(pairName);
-            position = unPaired.find(pairName);
-            if (position == unPaired.end()) {
+            // Search for the pair in the table
+            const char *pairName = bam1_qname(read);
+            if (!unPaired.take(pairName, batch.key_lengths[i], batch.hashes[i], &mate)) {
                 //I haven't seen the other member of this pair, so just save it
-                unPaired[pairName] = ostr.str();
+                unPaired.insert(batch.key_lengths[i], batch.hashes[i], read);
+                //Spill down to 3/4 of the limit, so we don't do it on every read
+                if (mates.spill && unPaired.memory() > max_memory)
+                    unPaired.spill_oldest(*mates.spill, max_memory / 4 * 3);
             } else {
                 //Aha!  This will be the second of the two.  Dump them both,
                 //then clean up
@@ -329,56 +1122,598 @@ void parse_bamfile(const char *bam_filename, const string &output_template) {
                 // Since we want to output interleaved pairs in stdout mode
                 // we need to take care to write them in the correct order
                 if(r_idx == 0) {
-                    *output[0] << ostr.str();
-                    *output[1] << position->second;
+                    output[0]->write(text, length);
+                    write_read(&mate, *output[1]);
                 } else {
-                    *output[0] << position->second;
-                    *output[1] << ostr.str();
+                    write_read(&mate, *output[0]);
+                    output[1]->write(text, length);
                 }
-                unPaired.erase(position);
+                write_batch_index(batch, i, output);
+            }
+        }
+    }
+    if (Stats::current)
+        Stats::current->pair_table_size(unPaired.peak_size(), unPaired.peak_memory());
+}
+
+//Saves a Checkpoint every so often, right after a batch has been written
+//out, so that its position is where the next batch starts
+struct Checkpointer {
+    Checkpointer(const string &input, size_t skipped_before)
+        : input(input), skipped_before(skipped_before), last(time(NULL)) {}
+
+    void after(const ReadBatch &batch, OutputFiles &files, Mates &mates) {
+        if (!batch.positioned || time(NULL) - last < checkpoint_interval)
+            return;
+        Checkpoint checkpoint;
+        checkpoint.input = input;
+        checkpoint.block = batch.next_block;
+        checkpoint.offset = batch.next_offset;
+        checkpoint.exported = batch.exported;
+        checkpoint.seen = batch.exported + skipped_before + batch.skipped;
+        bool ok = files.save(checkpoint);
+        if (secondary_output) {
+            struct stat st;
+            if (secondary_output->sync() && stat(secondary_output->path().c_str(), &st) == 0)
+                checkpoint.files.push_back(make_pair(secondary_output->path(),
+                                                     (uint64_t)st.st_size));
+            else
+                ok = false;
+        }
+        if (mates.waiting) {
+            checkpoint.waiting = true;
+            checkpoint.waiting_idx = mates.waiting_idx;
+            checkpoint.waiting_lane = mates.waiting_output.lane;
+            checkpoint.waiting_group = mates.waiting_output.group;
+            checkpoint.waiting_group_id = files.group_id(mates.waiting_output);
+            checkpoint.waiting_key = mates.waiting_key;
+            checkpoint.waiting_text = mates.waiting_text;
+        }
+        vector<bam1_t> pending;
+        mates.table.remaining(pending);
+        if (ok)
+            checkpoint.save(checkpoint_path, pending);
+        last = time(NULL);
+    }
+
+    string input;
+    //Records an earlier run had passed over
+    size_t skipped_before;
+    time_t last;
+};
+
+//Set while --checkpoint is saving them
+Checkpointer *checkpointer = NULL;
+
+//The consumer end of the formatting pool, when we have one
+struct BatchWriter {
+    BatchWriter(OrderedPool<ReadBatch> &pool, OutputFiles &output, Mates &mates)
+        : pool(pool), output(output), mates(mates) {}
+
+    void run() {
+        ReadBatch *batch;
+        while ((batch = pool.next()) != NULL) {
+            write_batch(*batch, output, mates);
+            if (checkpointer)
+                checkpointer->after(*batch, output, mates);
+            pool.release(batch);
+        }
+    }
+
+    OrderedPool<ReadBatch> &pool;
+    OutputFiles &output;
+    Mates &mates;
+};
+
+//Once the whole BAM has been read, match up whatever was spilled one
+//partition at a time.  Reads that still have no mate go to the _M file.
+void match_spilled(PairSpill &spill, OutputFiles &output) {
+    bam1_t *read = bam_init1();
+    bam1_t mate;
+    vector<bam1_t> leftovers;
+    size_t key_length;
+    uint64_t hash;
+
+    for (size_t p = 0; p < spill.partitions(); p++) {
+        PairTable table(4 << 20, output.needs_tags() || fastq_format.needs_tags());
+        while (spill.read(p, read, key_length, hash)) {
+            if (table.take(bam1_qname(read), key_length, hash, &mate))
+                write_pair(read, &mate, output.get(read));
+            else
+                table.insert(key_length, hash, read);
+        }
+        spill.close(p);
+
+        table.remaining(leftovers);
+        for (size_t i = 0; i < leftovers.size(); i++)
+            write_unpaired(&leftovers[i], output);
+    }
+    bam_destroy1(read);
+}
+
+//For --by-contig and --by-offset, each shard is read and formatted on its own thread, and
+//the batches are paired up and written out in whatever order they finish
+struct ShardReader {
+    ShardReader(BamInput *input, BlockingQueue<ReadBatch *> &empty,
+                BlockingQueue<ReadBatch *> &full, bam1_t *first)
+        : input(input), empty(empty), full(full), first(first), exported(0) {}
+
+    void run() {
+        bam1_t *read = first ? first : bam_init1();
+        bool more = first || input->read(read) > 0;
+        while (more) {
+            ReadBatch *batch = NULL;
+            empty.pop(batch);
+            fill_batch(input, read, more, batch, exported);
+            batch->run();
+            full.push(batch);
+        }
+        bam_destroy1(read);
+        full.close();
+    }
+
+    BamInput *input;
+    BlockingQueue<ReadBatch *> &empty;
+    BlockingQueue<ReadBatch *> &full;
+    //A record already read from input, which the reader then owns
+    bam1_t *first;
+    size_t exported;
+};
+
+//first, if there is one, is the first record of shards[0]
+void read_shards(const vector<BamInput *> &shards, OutputFiles &output, Mates &mates,
+                 size_t &all_seen, size_t &exported, bam1_t *first = NULL) {
+    //A few batches per shard keeps them all busy while we write
+    size_t batches = 3 * shards.size();
+    BlockingQueue<ReadBatch *> empty(batches);
+    BlockingQueue<ReadBatch *> full(batches, shards.size());
+    vector<ReadBatch *> all;
+    for (size_t i = 0; i < batches; i++) {
+        all.push_back(new ReadBatch());
+        empty.push(all.back());
+    }
+
+    vector<ShardReader *> readers;
+    vector<Thread<ShardReader> *> reader_threads;
+    for (size_t i = 0; i < shards.size(); i++) {
+        readers.push_back(new ShardReader(shards[i], empty, full, i == 0 ? first : NULL));
+        reader_threads.push_back(new Thread<ShardReader>(*readers.back()));
+    }
+
+    Progress progress(progress_interval);
+    size_t written = 0;
+    ReadBatch *batch;
+    while (full.pop(batch)) {
+        write_batch(*batch, output, mates);
+        written += batch->count;
+        empty.push(batch);
+        progress.update(exported + written);
+    }
+
+    for (size_t i = 0; i < readers.size(); i++) {
+        reader_threads[i]->join();
+        all_seen += readers[i]->exported + shards[i]->skipped();
+        exported += readers[i]->exported;
+    }
+    for_each(reader_threads.begin(), reader_threads.end(), DeleteObject());
+    for_each(readers.begin(), readers.end(), DeleteObject());
+    for_each(all.begin(), all.end(), DeleteObject());
+}
+
+//True if the @HD line has SO:queryname
+bool is_name_sorted(const bam_header_t *header) {
+    if (header == NULL || header->text == NULL || strncmp(header->text, "@HD", 3) != 0)
+        return false;
+    const char *text = header->text;
+    const char *end = strchr(text, '\n');
+    string hd(text, end ? end : text + strlen(text));
+    hd += '\t';
+    return hd.find("\tSO:queryname\t") != string::npos;
+}
+
+//Starting where from says, if it isn't NULL
+BamInput *open_input(const char *bam_filename, int inflate_threads,
+                     const Checkpoint *from = NULL) {
+    BamInput *input;
+    if (from)
+        input = open_bam_input_at(bam_filename, inflate_threads, use_mmap, from->block,
+                                  from->offset);
+    else if (regions.empty())
+        input = open_bam_input(bam_filename, inflate_threads, use_mmap);
+    else
+        input = open_region_input(bam_filename, regions);
+    if (input)
+        apply_flag_filter(input);
+    return input;
+}
+
+//Reads one input, or the shards of it that --by-contig or --by-offset
+//ask for.  read holds its first record, if more.
+void read_input(const char *bam_filename, BamInput *input, bam1_t *&read, bool more,
+                OutputFiles &output, Mates &mates, size_t &all_seen, size_t &exported) {
+    vector<BamInput *> shards;
+    if (by_contig && regions.empty()) {
+        if (!open_contig_shards(bam_filename, threads, shards))
+            cerr << bam_filename << " can't be split up with --by-contig, so reading it in one piece" << endl;
+    } else if (by_offset && regions.empty()) {
+        if (!open_byte_shards(bam_filename, threads, use_mmap, shards))
+            cerr << bam_filename << " can't be split up with --by-offset, so reading it in one piece" << endl;
+    }
+
+    if (shards.size() > 0) {
+        //The record we read for the lane number will come round again
+        for_each(shards.begin(), shards.end(), apply_flag_filter);
+        read_shards(shards, output, mates, all_seen, exported);
+        for_each(shards.begin(), shards.end(), DeleteObject());
+        return;
+    }
+
+    //With one thread everything happens right here, one batch at a time
+    OrderedPool<ReadBatch> *pool = NULL;
+    BatchWriter *writer = NULL;
+    Thread<BatchWriter> *writer_thread = NULL;
+    ReadBatch single;
+    if (threads > 1) {
+        pool = new OrderedPool<ReadBatch>(threads, 2 * threads + 2);
+        writer = new BatchWriter(*pool, output, mates);
+        writer_thread = new Thread<BatchWriter>(*writer);
+    }
+
+    Progress progress(progress_interval);
+    size_t start = exported;
+    while (more) {
+        ReadBatch *batch = pool ? pool->acquire() : &single;
+        fill_batch(input, read, more, batch, exported);
+        if (pool) {
+            pool->submit(batch);
+        } else {
+            batch->run();
+            write_batch(*batch, output, mates);
+            if (checkpointer)
+                checkpointer->after(*batch, output, mates);
+        }
+        progress.update(exported);
+    }
+    all_seen += exported - start + input->skipped();
+
+    if (pool) {
+        pool->finish();
+        writer_thread->join();
+        delete writer_thread;
+        delete writer;
+        delete pool;
+    }
+}
+
+//What --checkpoint can't cope with, or NULL
+const char *checkpoint_problem(const vector<const char *> &bam_filenames) {
+    if (bam_filenames.size() > 1)
+        return "more than one BAM file";
+    if (strcmp(bam_filenames[0], "-") == 0)
+        return "reading from stdin";
+    //It comes through a pipe from samtools, so there's nowhere to seek to
+    if (is_cram_input(bam_filenames[0]))
+        return "CRAM input";
+    if (stdout_pairs || stdout_all)
+        return "writing to stdout";
+    if (max_memory > 0)
+        return "--max-memory";
+    if (!regions.empty())
+        return "--region";
+    if (by_contig || by_offset)
+        return "--by-contig or --by-offset";
+    return NULL;
+}
+
+//Cuts the files back to the checkpoint's sizes.  False (after a message)
+//if one can't be.
+bool truncate_outputs(const Checkpoint &checkpoint) {
+    for (size_t i = 0; i < checkpoint.files.size(); i++) {
+        const string &path = checkpoint.files[i].first;
+        if (truncate(path.c_str(), checkpoint.files[i].second) != 0) {
+            cerr << "ERROR: could not cut " << path << " back to where the checkpoint was saved: "
+                 << strerror(errno) << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+//Picks up the reads the checkpoint had waiting for their mates
+void restore_mates(Checkpoint &checkpoint, const OutputFiles &files, Mates &mates) {
+    if (checkpoint.waiting) {
+        mates.waiting = true;
+        mates.waiting_idx = checkpoint.waiting_idx;
+        mates.waiting_output = files.saved_key(checkpoint.waiting_lane, checkpoint.waiting_group,
+                                               checkpoint.waiting_group_id);
+        mates.waiting_key = checkpoint.waiting_key;
+        mates.waiting_text = checkpoint.waiting_text;
+    }
+    for (size_t i = 0; i < checkpoint.pending.size(); i++) {
+        const bam1_t *read = checkpoint.pending[i];
+        size_t key_length = strict ? pair_key_length<true>(read) : pair_key_length<false>(read);
+        uint64_t hash = PairTable::hash(bam1_qname(read), key_length);
+        mates.table.insert(key_length, hash, read);
+    }
+}
+
+//Every input goes through the same pair table and output files, so mates
+//can be in different ones
+void parse_bamfiles(const vector<const char *> &bam_filenames, const string &output_template) {
+    bool parallel = parallel_inputs && bam_filenames.size() > 1;
+    int inflate_threads = by_contig || by_offset || parallel ? 1 : threads;
+
+    Checkpoint resumed;
+    bool resuming = false;
+    if (checkpoint_path) {
+        if (const char *problem = checkpoint_problem(bam_filenames)) {
+            cerr << "ERROR: --checkpoint doesn't work with " << problem << endl;
+            return;
+        }
+        if (resume && access(checkpoint_path, F_OK) == 0) {
+            if (!resumed.load(checkpoint_path))
+                return;
+            if (resumed.input != bam_filenames[0]) {
+                cerr << "ERROR: " << checkpoint_path << " is for " << resumed.input
+                     << ", not " << bam_filenames[0] << endl;
+                return;
             }
+            if (!truncate_outputs(resumed))
+                return;
+            resuming = true;
+            //The files are all ours, whether or not they were there yet
+            overwrite_files = 1;
+            if (print_msgs)
+                cerr << "Carrying on from " << checkpoint_path << ", with " << resumed.exported
+                     << " sequences already exported" << endl;
         }
+    }
 
-    } while (bam_read1(sam->x.bam, read) > 0);
+    BamInput *input = open_input(bam_filenames[0], inflate_threads, resuming ? &resumed : NULL);
+    if (input == NULL)
+        return;
+    bam1_t *read = bam_init1();
+    size_t exported = resuming ? resumed.exported : 0;
+    size_t all_seen = resuming ? resumed.seen : 0;
 
     //The documentation for bam_read1 says that it returns the number of
     //bytes read - which is true, unless it doesn't read any.  It returns
     //-1 for normal EOF and -2 for unexpected EOF.  So don't just wait for
     //it to return 0...
-    bam_destroy1(read);
-    samclose(sam);
+    bool more = input->read(read) > 0;
+    ReadGroups groups(input->header());
+    int lane = more ? groups.lane(read) : 0;
+
+    if (compress_format) {
+        Compressor::Format format = strcmp(compress_format, "bgzf") == 0 ? Compressor::BGZF
+                                                                         : Compressor::GZIP;
+        compressor = new Compressor(format, compress_level,
+                                    compress_threads ? compress_threads : threads);
+    }
+
+    OutputFiles *files;
+    bool opened;
+    if(stdout_pairs) {
+        files = new OutputFiles(initialize_paired_stdout());
+        opened = !files->get(read).empty();
+    } else if(stdout_all) {
+        files = new OutputFiles(initialize_all_stdout());
+        opened = !files->get(read).empty();
+    } else if (output_template.find('%') == string::npos &&
+               output_template.find(read_group_marker) == string::npos &&
+               output_template.find(chunk_marker) == string::npos) {
+        files = new OutputFiles(initialize_output(output_template, lane, "", resuming));
+        opened = !files->get(read).empty();
+    } else {
+        files = new OutputFiles(output_template, groups, max_open, lane);
+        if (resuming)
+            files->restore(resumed);
+        //Open the first read's files straight away, so that any problems
+        //with them show up before we start.  Without any reads, there's
+        //nothing to write.
+        opened = !more || !files->get(read).empty();
+    }
+    OutputFiles &output = *files;
+    if (opened && secondary_path) {
+        secondary_output = initialize_secondary(secondary_path, resuming);
+        opened = secondary_output != NULL;
+    }
+
+    if (!opened) {
+        bam_destroy1(read);
+        delete input;
+        delete files;
+        delete compressor;
+        return;
+    }
+
+    //Mates in different inputs are never next to each other, so only a
+    //single BAM can be taken as collated
+    bool paired = !stdout_all;
+    //Reading the inputs at once interleaves them too, --collated or not
+    if (((by_contig || by_offset) && regions.empty()) || parallel) {
+        collated = 0;
+    } else if (collated == -1) {
+        collated = bam_filenames.size() == 1 && is_name_sorted(input->header());
+        if (collated && print_msgs && paired)
+            cerr << "The BAM is sorted by read name, so mates are expected to be adjacent" << endl;
+    }
+
+    //Spilling happens a whole arena chunk at a time, so keep those small
+    //relative to the limit
+    Mates mates(max_memory ? min<size_t>(4 << 20, max<size_t>(max_memory / 16, 4096)) : 4 << 20,
+                output.needs_tags() || fastq_format.needs_tags());
+    if (max_memory > 0 && paired && !collated)
+        mates.spill = new PairSpill(spill_partitions);
+    if (resuming)
+        restore_mates(resumed, output, mates);
+    Checkpointer saver(bam_filenames[0], resuming ? resumed.seen - resumed.exported : 0);
+    if (checkpoint_path)
+        checkpointer = &saver;
+
+    if (parallel) {
+        //One reader thread per input, all at once
+        vector<BamInput *> inputs(1, input);
+        for (size_t i = 1; i < bam_filenames.size(); i++) {
+            BamInput *next = open_input(bam_filenames[i], 1);
+            if (next == NULL)
+                continue;
+            groups.add_header(next->header());
+            inputs.push_back(next);
+        }
+        read_shards(inputs, output, mates, all_seen, exported, more ? read : NULL);
+        if (!more)
+            bam_destroy1(read);
+        for_each(inputs.begin(), inputs.end(), DeleteObject());
+    } else {
+        read_input(bam_filenames[0], input, read, more, output, mates, all_seen, exported);
+        delete input;
+        for (size_t i = 1; i < bam_filenames.size(); i++) {
+            input = open_input(bam_filenames[i], inflate_threads);
+            if (input == NULL)
+                continue;
+            groups.add_header(input->header());
+            more = input->read(read) > 0;
+            read_input(bam_filenames[i], input, read, more, output, mates, all_seen, exported);
+            delete input;
+        }
+        bam_destroy1(read);
+    }
 
     // Write the remaining unpaired file to the single-end file
-    for(map<string, string>::iterator iter = unPaired.begin(); 
-            iter != unPaired.end(); ++iter) {
-        *output[2] << iter->second;
+    PairSpill *spill = mates.spill;
+    if (mates.waiting) {
+        const vector<OutputBuffer *> &waiting_output = output.get(mates.waiting_output);
+        if (!waiting_output.empty())
+            waiting_output[2]->write(mates.waiting_text.data(), mates.waiting_text.size());
+        if (Stats::current)
+            Stats::current->add_orphans(1);
+    } else if (spill && spill->spilled() > 0) {
+        //Some mates of what's left may be on disk, so everything goes there
+        mates.table.spill_oldest(*spill, 0);
+        if (print_msgs)
+            cerr << spill->spilled() << " reads were moved to temporary files while waiting for their mates" << endl;
+        if (spill->failed())
+            cerr << "ERROR: some reads waiting for their mates could not be written to temporary files" << endl;
+        match_spilled(*spill, output);
+    } else {
+        vector<bam1_t> leftovers;
+        mates.table.remaining(leftovers);
+        for(size_t i = 0; i < leftovers.size(); ++i)
+            write_unpaired(&leftovers[i], output);
     }
 
-    // Clean up filehandles
-    for(size_t i = 0; i < output.size(); ++i) {
-        if(output[i] != &std::cout)
-            delete output[i];
+    // Clean up filehandles, which flushes them
+    delete files;
+    delete secondary_output;
+    delete compressor;
+
+    //Finished, so there's nothing to resume
+    if (checkpointer) {
+        checkpointer = NULL;
+        unlink(checkpoint_path);
     }
 
     if (print_msgs) {
-        cerr << all_seen << " sequences in the BAM file" << endl;
+        cerr << all_seen << " sequences in the BAM file" << (bam_filenames.size() > 1 ? "s" : "") << endl;
         cerr << exported << " sequences exported" << endl;
     }
+    if (Stats::current) {
+        Stats::current->set_records(all_seen, exported);
+        Stats::current->report(cerr, strcmp(stats_format, "json") == 0);
+    }
+}
+
+//Decimal, hex (0x900) or octal, like samtools.  -1 if it isn't a flag value.
+int parse_flags(const char *text) {
+    char *end;
+    long value = strtol(text, &end, 0);
+    if (end == text || *end != '\0' || value < 0 || value > 0xffff)
+        return -1;
+    return value;
+}
+
+//A comma separated list of tags, like BC,RX
+bool parse_tags(const char *text, vector<string> &tags) {
+    tags.clear();
+    const char *p = text;
+    while (true) {
+        const char *comma = strchr(p, ',');
+        size_t length = comma ? comma - p : strlen(p);
+        if (length != 2 || !isalpha(p[0]) || !isalnum(p[1]) ||
+                tags.size() == FastqFormat::max_tags)
+            return false;
+        tags.push_back(string(p, 2));
+        if (!comma)
+            return true;
+        p = comma + 1;
+    }
+}
+
+//Parses sizes like 4096, 512K, 2G.  Returns 0 if it doesn't look like one.
+size_t parse_size(const char *text) {
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || value <= 0)
+        return 0;
+    switch (toupper(*end)) {
+        case 'K': value *= 1024.0; end++; break;
+        case 'M': value *= 1024.0 * 1024.0; end++; break;
+        case 'G': value *= 1024.0 * 1024.0 * 1024.0; end++; break;
+        case 'T': value *= 1024.0 * 1024.0 * 1024.0 * 1024.0; end++; break;
+    }
+    if (toupper(*end) == 'B')
+        end++;
+    if (*end != '\0')
+        return 0;
+    return static_cast<size_t>(value);
+}
+
+//Where --cpus and --numa-node put the threads
+CpuPlacement cpu_placement;
+
+//Sets up --cpus and --numa-node before any threads start.  False (after
+//a message) if they can't be used.
+bool place_threads(bool threads_set) {
+    vector<int> cpus;
+    if (cpu_list && !parse_cpu_list(cpu_list, cpus)) {
+        cerr << "Could not understand --cpus " << cpu_list << endl;
+        return false;
+    }
+    if (numa_node >= 0) {
+        vector<int> node_cpus;
+        if (!numa_node_cpus(numa_node, node_cpus))
+            return false;
+        if (cpu_list) {
+            vector<int> both;
+            for (size_t i = 0; i < cpus.size(); i++) {
+                if (find(node_cpus.begin(), node_cpus.end(), cpus[i]) != node_cpus.end())
+                    both.push_back(cpus[i]);
+            }
+            node_cpus.swap(both);
+        }
+        cpus.swap(node_cpus);
+        //First, so that everything the threads allocate comes from there
+        if (!prefer_numa_node(numa_node))
+            return false;
+    }
+    if (!cpu_placement.set_cpus(cpus))
+        return false;
+    thread_observer() = &cpu_placement;
+    //Decompressing and formatting each get this many threads, which
+    //spends the CPUs between them
+    if (!threads_set)
+        threads = max<size_t>(1, cpu_placement.cpus() / 2);
+    if (print_msgs)
+        cerr << "Running on " << cpu_placement.cpus() << " CPU" << (cpu_placement.cpus() > 1 ? "s" : "")
+             << ", with " << threads << " thread" << (threads > 1 ? "s" : "") << " per stage" << endl;
+    return true;
 }
 
 int main (int argc, char *argv[]) {
-    bases[1] = 'A';
-    bases[2] = 'C';
-    bases[4] = 'G';
-    bases[8] = 'T';
-    bases[15] = 'N';
-    //Complements (original index + 16)
-    bases[17] = 'T';
-    bases[18] = 'G';
-    bases[20] = 'C';
-    bases[24] = 'A';
-    bases[31] = 'N';
+    init_decode_tables();
     string output_template("s_%#_sequence.txt");
+    bool threads_set = false;
     int ch;
     while ((ch = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1)
         switch (ch) {
@@ -399,6 +1734,169 @@ int main (int argc, char *argv[]) {
             case 's' :
                 strict = 1;
                 break;
+            case 't' :
+                threads_set = true;
+                threads = atoi(optarg);
+                if (threads < 1) {
+                    cerr << "--threads must be at least 1" << endl;
+                    usage(2);
+                }
+                break;
+            case OPT_QUALITY_OFFSET :
+                fastq_format.offset = atoi(optarg);
+                if (fastq_format.offset < 33 || fastq_format.offset > 64) {
+                    cerr << "--quality-offset must be between 33 and 64" << endl;
+                    usage(2);
+                }
+                break;
+            case OPT_REGION :
+                regions.push_back(optarg);
+                break;
+            case OPT_WRITE_BUFFER :
+                write_buffer = parse_size(optarg);
+                if (write_buffer == 0) {
+                    cerr << "Could not understand --write-buffer " << optarg << endl;
+                    usage(2);
+                }
+                break;
+            case OPT_COMPRESS :
+                compress_format = optarg;
+                if (strcmp(optarg, "gz") != 0 && strcmp(optarg, "bgzf") != 0) {
+                    cerr << "--compress must be gz or bgzf" << endl;
+                    usage(2);
+                }
+                break;
+            case OPT_COMPRESS_LEVEL :
+                compress_level = atoi(optarg);
+                if (compress_level < 0 || compress_level > 9 || !isdigit(*optarg)) {
+                    cerr << "--compress-level must be between 0 and 9" << endl;
+                    usage(2);
+                }
+                break;
+            case OPT_COMPRESS_THREADS :
+                compress_threads = atoi(optarg);
+                if (compress_threads < 1) {
+                    cerr << "--compress-threads must be at least 1" << endl;
+                    usage(2);
+                }
+                break;
+            case OPT_MAX_OPEN :
+                if (atoi(optarg) < 2) {
+                    cerr << "--max-open must be at least 2" << endl;
+                    usage(2);
+                }
+                max_open = atoi(optarg);
+                break;
+            case OPT_STATS :
+                stats_format = optarg ? optarg : "text";
+                if (strcmp(stats_format, "text") != 0 && strcmp(stats_format, "json") != 0) {
+                    cerr << "--stats can only be text or json" << endl;
+                    usage(2);
+                }
+                break;
+            case OPT_PROGRESS :
+                progress_interval = optarg ? atoi(optarg) : 10;
+                if (progress_interval <= 0) {
+                    cerr << "--progress needs a number of seconds" << endl;
+                    usage(2);
+                }
+                break;
+            case OPT_SECONDARY_OUTPUT :
+                secondary_path = optarg;
+                break;
+            case OPT_NAME_SUFFIX :
+                if (strcmp(optarg, "mate") == 0)
+                    fastq_format.suffix = SUFFIX_MATE;
+                else if (strcmp(optarg, "none") == 0)
+                    fastq_format.suffix = SUFFIX_NONE;
+                else if (strcmp(optarg, "casava") == 0)
+                    fastq_format.suffix = SUFFIX_CASAVA;
+                else {
+                    cerr << "--name-suffix must be mate, none or casava" << endl;
+                    usage(2);
+                }
+                break;
+            case OPT_TAGS :
+                if (!parse_tags(optarg, fastq_format.tags)) {
+                    cerr << "--tags needs a list of up to " << FastqFormat::max_tags
+                         << " two character tags, like BC,RX" << endl;
+                    usage(2);
+                }
+                break;
+            case OPT_USE_OQ :
+                fastq_format.original_qualities = true;
+                break;
+            case OPT_INDEX_READS :
+                fastq_format.index_reads = true;
+                break;
+            case OPT_CHECKPOINT :
+                checkpoint_path = optarg;
+                break;
+            case OPT_CHECKPOINT_INTERVAL :
+                checkpoint_interval = atoi(optarg);
+                if (checkpoint_interval <= 0) {
+                    cerr << "--checkpoint-interval needs a number of seconds" << endl;
+                    usage(2);
+                }
+                break;
+            case OPT_SPLIT_READS :
+                if (!isdigit(*optarg) || atol(optarg) <= 0) {
+                    cerr << "--split-reads needs a number of reads" << endl;
+                    usage(2);
+                }
+                split_reads = atol(optarg);
+                break;
+            case OPT_SPLIT_BYTES :
+                split_bytes = parse_size(optarg);
+                if (split_bytes == 0) {
+                    cerr << "Could not understand --split-bytes " << optarg << endl;
+                    usage(2);
+                }
+                break;
+            case OPT_CPUS :
+                cpu_list = optarg;
+                break;
+            case OPT_NUMA_NODE :
+                numa_node = atoi(optarg);
+                if (!isdigit(*optarg)) {
+                    cerr << "--numa-node needs a node number" << endl;
+                    usage(2);
+                }
+                break;
+            case OPT_REFERENCE :
+                reference_path = optarg;
+                break;
+            case OPT_SAMTOOLS :
+                samtools_path = optarg;
+                break;
+            case OPT_UNPAIRED_OUTPUT :
+                unpaired_path = optarg;
+                break;
+            case OPT_STDOUT_QUEUE :
+                if (!isdigit(*optarg)) {
+                    cerr << "--stdout-queue needs a number of buffers" << endl;
+                    usage(2);
+                }
+                stdout_queue = atoi(optarg);
+                break;
+            case OPT_REQUIRE_FLAGS :
+            case OPT_EXCLUDE_FLAGS : {
+                int flags = parse_flags(optarg);
+                if (flags < 0) {
+                    cerr << "Could not understand --" << (ch == OPT_REQUIRE_FLAGS ? "require" : "exclude")
+                         << "-flags " << optarg << endl;
+                    usage(2);
+                }
+                (ch == OPT_REQUIRE_FLAGS ? require_flags : exclude_flags) = flags;
+                break;
+            }
+            case OPT_MAX_MEMORY :
+                max_memory = parse_size(optarg);
+                if (max_memory == 0) {
+                    cerr << "Could not understand --max-memory " << optarg << endl;
+                    usage(2);
+                }
+                break;
             case '?' : //Unrecognized option
                 usage(2);
             //The remaining options will set the appropriate variable themselves
@@ -407,6 +1905,32 @@ int main (int argc, char *argv[]) {
     argv += optind;
     if (argc == 0)
         usage(1);
-    parse_bamfile(argv[0], output_template);
+    if (resume && checkpoint_path == NULL) {
+        cerr << "--resume needs --checkpoint" << endl;
+        usage(2);
+    }
+    if (fastq_format.index_reads && (stdout_pairs || stdout_all)) {
+        cerr << "--index-reads needs output files, not stdout" << endl;
+        usage(2);
+    }
+    bool chunked = output_template.find(chunk_marker) != string::npos;
+    if ((split_reads || split_bytes) && (!chunked || stdout_pairs || stdout_all)) {
+        cerr << "--split-reads and --split-bytes need output files with {chunk} in their names"
+             << endl;
+        usage(2);
+    }
+    if (chunked && !split_reads && !split_bytes) {
+        cerr << "{chunk} in --output needs --split-reads or --split-bytes" << endl;
+        usage(2);
+    }
+    if (cpu_list || numa_node >= 0) {
+        if (!place_threads(threads_set))
+            return 1;
+    }
+    Stats stats;
+    if (stats_format)
+        Stats::current = &stats;
+    set_cram_decoder(samtools_path, reference_path);
+    parse_bamfiles(vector<const char *>(argv, argv + argc), output_template);
     return 0;
 }
@@ -0,0 +1,1032 @@
+/*
+Copyright 2010, HudsonAlpha Institute for Biotechnology
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+bam_input.cpp
+
+Sources of BAM records for parse_bamfile
+*/
+
+#include "bam_input.h"
+#include "threads.h"
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <stdint.h>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+const size_t BGZF_MAX_BLOCK = 0x10000;
+const size_t BGZF_HEADER = 12;
+const size_t BGZF_FOOTER = 8;
+
+inline uint32_t le32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+inline uint16_t le16(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+bool is_big_endian() {
+    uint16_t one = 1;
+    return *reinterpret_cast<unsigned char *>(&one) == 0;
+}
+
+//read(2), but keeps going until len bytes or EOF
+ssize_t read_fully(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = ::read(fd, static_cast<char *>(buf) + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+//The bundled samtools reader - used unless we've been asked for threads
+class SamfileInput : public BamInput {
+public:
+    explicit SamfileInput(samfile_t *sam) : m_sam(sam) {}
+    ~SamfileInput() { samclose(m_sam); }
+    bam_header_t *header() { return m_sam->header; }
+    //bam_read1 copies the whole record before we can look at it
+    int read(bam1_t *b) {
+        int ret;
+        while ((ret = bam_read1(m_sam->x.bam, b)) > 0 && !wanted(b->core.flag))
+            m_skipped++;
+        return ret;
+    }
+    //The BGZF virtual offset is the same thing in one number
+    bool position(uint64_t &block, size_t &offset) {
+        int64_t at = bam_tell(m_sam->x.bam);
+        block = at >> 16;
+        offset = at & 0xffff;
+        return true;
+    }
+private:
+    samfile_t *m_sam;
+};
+
+struct IndexRegion {
+    IndexRegion(int tid, int beg, int end) : tid(tid), beg(beg), end(end) {}
+    bool operator<(const IndexRegion &other) const { return tid < other.tid; }
+    int tid;
+    int beg;
+    int end;
+};
+
+//Big enough to cover any contig a BAM index can describe
+const int whole_contig = 1 << 29;
+
+//Iterates over regions through the index.  A tail input reads on to the
+//end of the file once it gets into its last region, which picks up the
+//unmapped reads that follow the last contig.  A tail input with no
+//regions at all just reads the whole file.
+class IndexedInput : public BamInput {
+public:
+    IndexedInput(samfile_t *sam, bam_index_t *index, const vector<IndexRegion> &regions, bool tail)
+        : m_sam(sam), m_index(index), m_regions(regions), m_next(0), m_iter(NULL),
+          m_streaming(tail && regions.empty()), m_tail(tail) {}
+
+    ~IndexedInput() {
+        if (m_iter)
+            bam_iter_destroy(m_iter);
+        bam_index_destroy(m_index);
+        samclose(m_sam);
+    }
+
+    bam_header_t *header() { return m_sam->header; }
+
+    int read(bam1_t *b) {
+        while (true) {
+            if (m_streaming) {
+                int ret = bam_read1(m_sam->x.bam, b);
+                if (ret > 0 && !wanted(b->core.flag)) {
+                    m_skipped++;
+                    continue;
+                }
+                return ret;
+            }
+            if (m_iter == NULL) {
+                if (m_next == m_regions.size())
+                    return -1;
+                const IndexRegion &r = m_regions[m_next++];
+                m_iter = bam_iter_query(m_index, r.tid, r.beg, r.end);
+            }
+            int ret = bam_iter_read(m_sam->x.bam, m_iter, b);
+            if (ret < 0) {
+                bam_iter_destroy(m_iter);
+                m_iter = NULL;
+                continue;
+            }
+            if (m_tail && m_next == m_regions.size()) {
+                //The iterator has left the file just after this read
+                bam_iter_destroy(m_iter);
+                m_iter = NULL;
+                m_streaming = true;
+            }
+            if (seen_before(b))
+                continue;
+            if (!wanted(b->core.flag)) {
+                m_skipped++;
+                continue;
+            }
+            return ret;
+        }
+    }
+
+private:
+    //True if b overlaps one of the regions before the current one
+    bool seen_before(const bam1_t *b) const {
+        int beg = b->core.pos;
+        int end = max<int>(bam_calend(&b->core, bam1_cigar(b)), beg + 1);
+        for (size_t i = 0; i + 1 < m_next; i++) {
+            const IndexRegion &r = m_regions[i];
+            if (r.tid == b->core.tid && beg < r.end && end > r.beg)
+                return true;
+        }
+        return false;
+    }
+
+    samfile_t *m_sam;
+    bam_index_t *m_index;
+    vector<IndexRegion> m_regions;
+    size_t m_next;
+    bam_iter_t m_iter;
+    bool m_streaming;
+    bool m_tail;
+};
+
+//Opens the BAM and its index, printing a message if either fails
+bool open_indexed(const char *filename, samfile_t *&sam, bam_index_t *&index) {
+    sam = samopen(filename, "rb", NULL);
+    if (sam == NULL) {
+        cerr << "Could not open " << filename << endl;
+        return false;
+    }
+    index = bam_index_load(filename);
+    if (index == NULL) {
+        cerr << "Could not load the index for " << filename
+             << " (it can be created with samtools index)" << endl;
+        samclose(sam);
+        return false;
+    }
+    return true;
+}
+
+//The size of a BGZF block from the BC subfield of its gzip extra field, or
+//0 if it hasn't got one.  buf holds the fixed header and xlen extra bytes.
+size_t bgzf_block_size(const unsigned char *buf, size_t xlen) {
+    size_t bsize = 0;
+    for (size_t i = BGZF_HEADER; i + 4 <= BGZF_HEADER + xlen; ) {
+        size_t slen = le16(buf + i + 2);
+        if (buf[i] == 66 && buf[i+1] == 67 && slen == 2 && i + 6 <= BGZF_HEADER + xlen)
+            bsize = le16(buf + i + 4) + 1;
+        i += 4 + slen;
+    }
+    return bsize;
+}
+
+inline bool is_bgzf_header(const unsigned char *buf) {
+    return buf[0] == 31 && buf[1] == 139 && buf[2] == 8 && (buf[3] & 4);
+}
+
+//One BGZF block, read off disk by the consumer and inflated by a worker.
+//source is either compressed, or the block itself in a mapped file.
+struct BgzfBlock {
+    BgzfBlock()
+        : compressed(BGZF_MAX_BLOCK), source(NULL), offset(0), compressed_length(0),
+          header_length(0), data(BGZF_MAX_BLOCK), length(0), eof(false), error(false) {
+        memset(&zs, 0, sizeof(zs));
+        inflateInit2(&zs, -15);
+    }
+    ~BgzfBlock() { inflateEnd(&zs); }
+
+    void run() {
+        if (eof || error)
+            return;
+        inflateReset(&zs);
+        zs.next_in = const_cast<unsigned char *>(source + header_length);
+        zs.avail_in = compressed_length - header_length - BGZF_FOOTER;
+        zs.next_out = &data[0];
+        zs.avail_out = data.size();
+        int ret = inflate(&zs, Z_FINISH);
+        length = zs.total_out;
+        if (ret != Z_STREAM_END || length != le32(source + compressed_length - 4))
+            error = true;
+    }
+
+    vector<unsigned char> compressed;
+    const unsigned char *source;
+    //Where the block starts in the file
+    uint64_t offset;
+    size_t compressed_length;
+    size_t header_length;
+    vector<unsigned char> data;
+    size_t length;
+    bool eof;
+    bool error;
+    z_stream zs;
+};
+
+//Reads compressed blocks sequentially, inflates them on a thread pool, and
+//parses records out of the inflated blocks in their original order
+class ThreadedBgzfInput : public BamInput {
+public:
+    ThreadedBgzfInput(const char *filename, int fd, int threads)
+        : m_filename(filename), m_fd(fd), m_file_offset(0), m_map(NULL), m_map_size(0),
+          m_map_offset(0), m_pool(threads, 4 * threads), m_pending(0), m_current(NULL),
+          m_offset(0), m_eof(false), m_header(NULL), m_has_end(false), m_end_block(0),
+          m_end_offset(0), m_decoder(0) {}
+
+    ~ThreadedBgzfInput() {
+        if (m_current)
+            m_pool.release(m_current);
+        if (m_header)
+            bam_header_destroy(m_header);
+        if (m_map)
+            munmap(const_cast<unsigned char *>(m_map), m_map_size);
+        if (m_fd != 0)
+            close(m_fd);
+        //With the pipe closed, a decoder that isn't done yet gets SIGPIPE
+        if (m_decoder)
+            waitpid(m_decoder, NULL, 0);
+    }
+
+    bam_header_t *header() { return m_header; }
+
+    //Reads the blocks straight out of a mapping of the whole file, rather
+    //than copying them in.  Returns false if the file can't be mapped
+    //(it's a pipe, say), in which case we carry on with read(2).
+    bool map_file();
+    bool read_header();
+    int read(bam1_t *b);
+
+    //For reading part of a file: starts offset bytes into the inflated
+    //block at block, instead of at the header
+    bool seek(uint64_t block, size_t offset);
+    //Stops at the record that starts offset bytes into block
+    void set_end(uint64_t block, size_t offset) {
+        m_has_end = true;
+        m_end_block = block;
+        m_end_offset = offset;
+    }
+    //Where the next record starts.  False at EOF.
+    bool position(uint64_t &block, size_t &offset);
+
+    //Takes over the header other read, for an input that seek()s past it
+    void adopt_header(ThreadedBgzfInput &other) {
+        m_header = other.m_header;
+        other.m_header = NULL;
+    }
+
+    //The file descriptor is a pipe from this process, which has to have
+    //exited cleanly for EOF to count as the end of the file
+    void set_decoder(pid_t pid) { m_decoder = pid; }
+
+private:
+    bool finish_decoder();
+    bool fill_block(BgzfBlock *block);
+    bool map_block(BgzfBlock *block);
+    bool next_block();
+    //With a NULL dest the bytes are just skipped
+    size_t read_bytes(void *dest, size_t len);
+
+    string m_filename;
+    int m_fd;
+    uint64_t m_file_offset;
+    const unsigned char *m_map;
+    size_t m_map_size;
+    size_t m_map_offset;
+    OrderedPool<BgzfBlock> m_pool;
+    size_t m_pending;
+    BgzfBlock *m_current;
+    size_t m_offset;
+    bool m_eof;
+    bam_header_t *m_header;
+
+    bool m_has_end;
+    uint64_t m_end_block;
+    size_t m_end_offset;
+
+    pid_t m_decoder;
+};
+
+bool ThreadedBgzfInput::map_file() {
+    struct stat st;
+    if (fstat(m_fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return false;
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+    if (map == MAP_FAILED)
+        return false;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    m_map = static_cast<const unsigned char *>(map);
+    m_map_size = st.st_size;
+    return true;
+}
+
+//Returns false at EOF or on a bad block, with the reason flagged on block
+bool ThreadedBgzfInput::fill_block(BgzfBlock *block) {
+    block->eof = false;
+    block->error = false;
+    block->length = 0;
+    if (m_map)
+        return map_block(block);
+
+    unsigned char *buf = &block->compressed[0];
+    block->source = buf;
+    block->offset = m_file_offset;
+
+    ssize_t n = read_fully(m_fd, buf, BGZF_HEADER);
+    if (n == 0) {
+        block->eof = true;
+        return false;
+    }
+    if (n != (ssize_t)BGZF_HEADER || !is_bgzf_header(buf)) {
+        block->error = true;
+        return false;
+    }
+
+    //The block size lives in the BC subfield of the gzip extra field
+    size_t xlen = le16(buf + 10);
+    if (BGZF_HEADER + xlen > BGZF_MAX_BLOCK ||
+            read_fully(m_fd, buf + BGZF_HEADER, xlen) != (ssize_t)xlen) {
+        block->error = true;
+        return false;
+    }
+    size_t bsize = bgzf_block_size(buf, xlen);
+    block->header_length = BGZF_HEADER + xlen;
+    if (bsize < block->header_length + BGZF_FOOTER || bsize > BGZF_MAX_BLOCK) {
+        block->error = true;
+        return false;
+    }
+
+    size_t rest = bsize - block->header_length;
+    if (read_fully(m_fd, buf + block->header_length, rest) != (ssize_t)rest) {
+        block->error = true;
+        return false;
+    }
+    block->compressed_length = bsize;
+    m_file_offset += bsize;
+    return true;
+}
+
+//The same checks as fill_block, but the block stays where it is
+bool ThreadedBgzfInput::map_block(BgzfBlock *block) {
+    size_t left = m_map_size - m_map_offset;
+    if (left == 0) {
+        block->eof = true;
+        return false;
+    }
+    const unsigned char *buf = m_map + m_map_offset;
+    if (left < BGZF_HEADER || !is_bgzf_header(buf) ||
+            BGZF_HEADER + le16(buf + 10) > min(left, BGZF_MAX_BLOCK)) {
+        block->error = true;
+        return false;
+    }
+    size_t xlen = le16(buf + 10);
+    size_t bsize = bgzf_block_size(buf, xlen);
+    block->header_length = BGZF_HEADER + xlen;
+    if (bsize < block->header_length + BGZF_FOOTER || bsize > left) {
+        block->error = true;
+        return false;
+    }
+    block->source = buf;
+    block->offset = m_map_offset;
+    block->compressed_length = bsize;
+    m_map_offset += bsize;
+    return true;
+}
+
+//Moves on to the next non-empty inflated block
+bool ThreadedBgzfInput::next_block() {
+    if (m_current) {
+        m_pool.release(m_current);
+        m_current = NULL;
+    }
+    while (true) {
+        //Keep the workers busy with everything we have room for
+        while (!m_eof && !m_pool.full()) {
+            BgzfBlock *block = m_pool.acquire();
+            if (!fill_block(block))
+                m_eof = true;
+            m_pool.submit(block);
+            m_pending++;
+        }
+        if (m_pending == 0)
+            return false;
+
+        BgzfBlock *block = m_pool.next();
+        m_pending--;
+        if (block->error)
+            cerr << "ERROR: " << m_filename << " contains a corrupt or truncated BGZF block" << endl;
+        if (block->eof || block->error) {
+            m_pool.release(block);
+            return false;
+        }
+        if (block->length == 0) {
+            //The EOF marker, or just an empty block
+            m_pool.release(block);
+            continue;
+        }
+        m_current = block;
+        m_offset = 0;
+        return true;
+    }
+}
+
+size_t ThreadedBgzfInput::read_bytes(void *dest, size_t len) {
+    unsigned char *out = static_cast<unsigned char *>(dest);
+    size_t done = 0;
+    while (done < len) {
+        if (m_current == NULL || m_offset == m_current->length) {
+            if (!next_block())
+                break;
+        }
+        size_t n = min(len - done, m_current->length - m_offset);
+        if (out)
+            memcpy(out + done, &m_current->data[m_offset], n);
+        m_offset += n;
+        done += n;
+    }
+    return done;
+}
+
+bool ThreadedBgzfInput::read_header() {
+    unsigned char buf[4];
+    if (read_bytes(buf, 4) != 4 || memcmp(buf, "BAM\1", 4) != 0)
+        return false;
+
+    bam_header_t *header = bam_header_init();
+    m_header = header;
+    if (read_bytes(buf, 4) != 4)
+        return false;
+    header->l_text = le32(buf);
+    header->text = static_cast<char *>(calloc(header->l_text + 1, 1));
+    if (read_bytes(header->text, header->l_text) != header->l_text)
+        return false;
+
+    if (read_bytes(buf, 4) != 4)
+        return false;
+    int32_t n_targets = le32(buf);
+    if (n_targets < 0)
+        return false;
+    header->target_name = static_cast<char **>(calloc(n_targets, sizeof(char *)));
+    header->target_len = static_cast<uint32_t *>(calloc(n_targets, sizeof(uint32_t)));
+    for (int32_t i = 0; i < n_targets; i++) {
+        if (read_bytes(buf, 4) != 4)
+            return false;
+        uint32_t l_name = le32(buf);
+        header->target_name[i] = static_cast<char *>(calloc(l_name + 1, 1));
+        header->n_targets = i + 1;
+        if (read_bytes(header->target_name[i], l_name) != l_name || read_bytes(buf, 4) != 4)
+            return false;
+        header->target_len[i] = le32(buf);
+    }
+    return true;
+}
+
+bool ThreadedBgzfInput::seek(uint64_t block, size_t offset) {
+    if (m_map) {
+        if (block > m_map_size)
+            return false;
+        m_map_offset = block;
+    } else if (lseek(m_fd, block, SEEK_SET) < 0) {
+        return false;
+    }
+    m_file_offset = block;
+    return read_bytes(NULL, offset) == offset;
+}
+
+bool ThreadedBgzfInput::position(uint64_t &block, size_t &offset) {
+    if (m_current == NULL || m_offset == m_current->length) {
+        if (!next_block())
+            return false;
+    }
+    block = m_current->offset;
+    offset = m_offset;
+    return true;
+}
+
+//This is bam_read1, reading from our blocks instead of a BGZF handle.
+//Unwanted records are skipped once we have their flags, without copying
+//the rest of them.
+int ThreadedBgzfInput::read(bam1_t *b) {
+    while (true) {
+        if (m_has_end) {
+            uint64_t block;
+            size_t offset;
+            if (!position(block, offset))
+                return -1;
+            if (block > m_end_block || (block == m_end_block && offset >= m_end_offset)) {
+                //The next shard guessed where a record started, and got it wrong
+                if (block != m_end_block || offset != m_end_offset)
+                    cerr << "ERROR: " << m_filename << " could not be split up at a record boundary,"
+                         << " so some reads may be missing or garbled.  Try again without --by-offset" << endl;
+                return -1;
+            }
+        }
+        unsigned char buf[36];
+        size_t n = read_bytes(buf, 4);
+        if (n == 0)
+            return finish_decoder() ? -1 : -2;
+        if (n != 4)
+            return -2;
+        int32_t block_len = le32(buf);
+        if (block_len < 32 || read_bytes(buf + 4, 32) != 32)
+            return -3;
+
+        bam1_core_t *c = &b->core;
+        uint32_t x[8];
+        for (int i = 0; i < 8; i++)
+            x[i] = le32(buf + 4 + 4*i);
+        if (!wanted(x[3] >> 16)) {
+            if (read_bytes(NULL, block_len - 32) != (size_t)(block_len - 32))
+                return -4;
+            m_skipped++;
+            continue;
+        }
+        c->tid = x[0];
+        c->pos = x[1];
+        c->bin = x[2] >> 16;
+        c->qual = x[2] >> 8 & 0xff;
+        c->l_qname = x[2] & 0xff;
+        c->flag = x[3] >> 16;
+        c->n_cigar = x[3] & 0xffff;
+        c->l_qseq = x[4];
+        c->mtid = x[5];
+        c->mpos = x[6];
+        c->isize = x[7];
+
+        b->data_len = block_len - 32;
+        if (b->m_data < b->data_len) {
+            b->m_data = b->data_len;
+            kroundup32(b->m_data);
+            b->data = static_cast<uint8_t *>(realloc(b->data, b->m_data));
+        }
+        if (read_bytes(b->data, b->data_len) != (size_t)b->data_len)
+            return -4;
+        b->l_aux = b->data_len - c->n_cigar * 4 - c->l_qname - c->l_qseq - (c->l_qseq + 1) / 2;
+        return 4 + block_len;
+    }
+}
+
+bool ThreadedBgzfInput::finish_decoder() {
+    if (m_decoder == 0)
+        return true;
+    int status;
+    pid_t pid = m_decoder;
+    m_decoder = 0;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        cerr << "ERROR: the CRAM decoder for " << m_filename << " failed" << endl;
+        return false;
+    }
+    return true;
+}
+
+//pread(2), with the same guarantees as read_fully
+ssize_t pread_fully(int fd, void *buf, size_t len, uint64_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = ::pread(fd, static_cast<char *>(buf) + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+//The size of the BGZF block at offset, or 0 if there isn't one there
+size_t block_size_at(int fd, uint64_t offset) {
+    unsigned char buf[BGZF_MAX_BLOCK];
+    if (pread_fully(fd, buf, BGZF_HEADER, offset) != (ssize_t)BGZF_HEADER || !is_bgzf_header(buf))
+        return 0;
+    size_t xlen = le16(buf + 10);
+    if (BGZF_HEADER + xlen > BGZF_MAX_BLOCK ||
+            pread_fully(fd, buf + BGZF_HEADER, xlen, offset + BGZF_HEADER) != (ssize_t)xlen)
+        return 0;
+    size_t bsize = bgzf_block_size(buf, xlen);
+    return bsize >= BGZF_HEADER + xlen + BGZF_FOOTER ? bsize : 0;
+}
+
+//The first offset at or after from where a BGZF block starts, as far as
+//we can tell: it has to look like one, and so does the block after it.
+//Returns size if there isn't one.
+uint64_t find_block(int fd, uint64_t size, uint64_t from) {
+    for (uint64_t offset = from; offset + BGZF_HEADER <= size; offset++) {
+        size_t bsize = block_size_at(fd, offset);
+        if (bsize == 0 || offset + bsize > size)
+            continue;
+        if (offset + bsize == size || block_size_at(fd, offset + bsize) != 0)
+            return offset;
+    }
+    return size;
+}
+
+//Inflates the block at offset onto the end of data.  Returns its
+//compressed size, or 0 if it's corrupt.
+size_t inflate_block_at(int fd, uint64_t offset, vector<unsigned char> &data) {
+    size_t bsize = block_size_at(fd, offset);
+    if (bsize == 0)
+        return 0;
+    vector<unsigned char> raw(bsize);
+    if (pread_fully(fd, &raw[0], bsize, offset) != (ssize_t)bsize)
+        return 0;
+    size_t header_length = BGZF_HEADER + le16(&raw[10]);
+    size_t start = data.size();
+    data.resize(start + BGZF_MAX_BLOCK);
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    inflateInit2(&zs, -15);
+    zs.next_in = &raw[header_length];
+    zs.avail_in = bsize - header_length - BGZF_FOOTER;
+    zs.next_out = &data[start];
+    zs.avail_out = BGZF_MAX_BLOCK;
+    int ret = inflate(&zs, Z_FINISH);
+    data.resize(start + zs.total_out);
+    inflateEnd(&zs);
+    return ret == Z_STREAM_END ? bsize : 0;
+}
+
+//Whether the len bytes at p could be the start of a BAM record, judging
+//by the fixed fields and the name.  size is the whole record's.
+bool plausible_record(const unsigned char *p, size_t len, int32_t n_targets, size_t &size) {
+    if (len < 36)
+        return false;
+    int32_t block_len = le32(p);
+    int32_t tid = le32(p + 4);
+    int32_t pos = le32(p + 8);
+    size_t l_qname = p[12];
+    size_t n_cigar = le16(p + 16);
+    int32_t l_qseq = le32(p + 20);
+    int32_t mtid = le32(p + 24);
+    int32_t mpos = le32(p + 28);
+    if (block_len < 32 || block_len > (1 << 28) || tid < -1 || tid >= n_targets ||
+            mtid < -1 || mtid >= n_targets || pos < -1 || mpos < -1 || l_qname < 1 || l_qseq < 0)
+        return false;
+    if (32 + l_qname + 4 * n_cigar + (l_qseq + 1) / 2 + (size_t)l_qseq > (size_t)block_len)
+        return false;
+    if (36 + l_qname <= len) {
+        const unsigned char *name = p + 36;
+        if (name[l_qname - 1] != 0)
+            return false;
+        for (size_t i = 0; i + 1 < l_qname; i++)
+            if (name[i] < '!' || name[i] > '~')
+                return false;
+    }
+    size = 4 + block_len;
+    return true;
+}
+
+//Looks for a record starting in the first limit bytes of data, from which
+//every record through to the end of data looks right.  Returns limit if
+//there isn't one.
+size_t find_record(const vector<unsigned char> &data, size_t limit, int32_t n_targets) {
+    for (size_t start = 0; start < limit; start++) {
+        size_t offset = start;
+        size_t records = 0;
+        size_t size;
+        while (offset < data.size() &&
+                plausible_record(&data[offset], data.size() - offset, n_targets, size)) {
+            records++;
+            offset += size;
+        }
+        //The one that runs off the end only needs to look right so far
+        if (offset >= data.size() || (data.size() - offset < 36 && records > 0)) {
+            if (records >= 2)
+                return start;
+        }
+    }
+    return limit;
+}
+
+//How many blocks of data to check a guessed record boundary against
+const int sync_blocks = 4;
+
+const char *cram_samtools = "samtools";
+const char *cram_reference = NULL;
+
+bool is_cram(const char *filename) {
+    if (strcmp(filename, "-") == 0)
+        return false;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+    char magic[4];
+    bool cram = read_fully(fd, magic, 4) == 4 && memcmp(magic, "CRAM", 4) == 0;
+    close(fd);
+    return cram;
+}
+
+//Runs samtools view on filename, writing uncompressed BAM to a pipe.
+//Returns the read end of the pipe, or -1.
+int spawn_cram_decoder(const char *filename, int threads, pid_t &pid) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        cerr << "ERROR: could not create a pipe: " << strerror(errno) << endl;
+        return -1;
+    }
+    char thread_count[16];
+    snprintf(thread_count, sizeof(thread_count), "%d", threads);
+    vector<const char *> argv;
+    argv.push_back(cram_samtools);
+    argv.push_back("view");
+    argv.push_back("-u");
+    argv.push_back("-@");
+    argv.push_back(thread_count);
+    if (cram_reference) {
+        argv.push_back("-T");
+        argv.push_back(cram_reference);
+    }
+    argv.push_back(filename);
+    argv.push_back(NULL);
+
+    pid = fork();
+    if (pid < 0) {
+        cerr << "ERROR: could not start " << cram_samtools << ": " << strerror(errno) << endl;
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execvp(argv[0], const_cast<char *const *>(&argv[0]));
+        cerr << "ERROR: could not run " << cram_samtools << ": " << strerror(errno) << endl;
+        _exit(127);
+    }
+    close(fds[1]);
+    return fds[0];
+}
+
+//libbam can't read CRAM, so samtools does the decoding, on its own
+//threads, and we parse the BAM it streams back without a second pass
+//through the filesystem
+BamInput *open_cram_input(const char *filename, int threads) {
+    if (is_big_endian()) {
+        cerr << "ERROR: CRAM input isn't supported on big endian machines" << endl;
+        return NULL;
+    }
+    pid_t pid;
+    int fd = spawn_cram_decoder(filename, threads, pid);
+    if (fd < 0)
+        return NULL;
+    //Uncompressed BAM still comes in BGZF blocks, but they're cheap to
+    //unpack, so one thread is plenty
+    ThreadedBgzfInput *input = new ThreadedBgzfInput(filename, fd, 1);
+    input->set_decoder(pid);
+    if (!input->read_header()) {
+        cerr << "Could not read a header from " << filename << " through " << cram_samtools << endl;
+        delete input;
+        return NULL;
+    }
+    return input;
+}
+
+}
+
+void set_cram_decoder(const char *samtools, const char *reference) {
+    cram_samtools = samtools;
+    cram_reference = reference;
+}
+
+bool is_cram_input(const char *filename) {
+    return is_cram(filename);
+}
+
+BamInput *open_bam_input(const char *filename, int threads, bool map) {
+    if (is_cram(filename))
+        return open_cram_input(filename, threads);
+
+    //The data section of a record would need byte-swapping on big endian
+    //machines, which libbam already knows how to do
+    if ((threads > 1 || map) && !is_big_endian()) {
+        int fd = (strcmp(filename, "-") == 0) ? 0 : open(filename, O_RDONLY);
+        if (fd < 0) {
+            cerr << "Could not open " << filename << endl;
+            return NULL;
+        }
+        ThreadedBgzfInput *input = new ThreadedBgzfInput(filename, fd, threads);
+        if (map && !input->map_file())
+            cerr << "Could not map " << filename << " into memory, so reading it instead" << endl;
+        if (!input->read_header()) {
+            cerr << "Could not read a BAM header from " << filename << endl;
+            delete input;
+            return NULL;
+        }
+        return input;
+    }
+
+    samfile_t *sam = samopen(filename, "rb", NULL);
+    if (sam == NULL) {
+        cerr << "Could not open " << filename << endl;
+        return NULL;
+    }
+    return new SamfileInput(sam);
+}
+
+BamInput *open_bam_input_at(const char *filename, int threads, bool map, uint64_t block,
+                            size_t offset) {
+    if (strcmp(filename, "-") == 0 || is_big_endian() || is_cram(filename)) {
+        cerr << "ERROR: " << filename << " can't be read from part of the way through" << endl;
+        return NULL;
+    }
+    ThreadedBgzfInput head(filename, open(filename, O_RDONLY), 1);
+    if (!head.read_header()) {
+        cerr << "Could not read a BAM header from " << filename << endl;
+        return NULL;
+    }
+    ThreadedBgzfInput *input = new ThreadedBgzfInput(filename, open(filename, O_RDONLY), threads);
+    if (map && !input->map_file())
+        cerr << "Could not map " << filename << " into memory, so reading it instead" << endl;
+    if (!input->seek(block, offset)) {
+        cerr << "ERROR: could not find the place to carry on from in " << filename << endl;
+        delete input;
+        return NULL;
+    }
+    input->adopt_header(head);
+    return input;
+}
+
+BamInput *open_region_input(const char *filename, const vector<string> &regions) {
+    samfile_t *sam;
+    bam_index_t *index;
+    if (!open_indexed(filename, sam, index))
+        return NULL;
+
+    vector<IndexRegion> parsed;
+    for (size_t i = 0; i < regions.size(); i++) {
+        int tid, beg, end;
+        if (bam_parse_region(sam->header, regions[i].c_str(), &tid, &beg, &end) != 0 || tid < 0) {
+            cerr << "Could not find region " << regions[i] << " in " << filename << endl;
+            bam_index_destroy(index);
+            samclose(sam);
+            return NULL;
+        }
+        parsed.push_back(IndexRegion(tid, beg, end));
+    }
+    return new IndexedInput(sam, index, parsed, false);
+}
+
+bool open_contig_shards(const char *filename, size_t n, vector<BamInput *> &shards) {
+    samfile_t *sam;
+    bam_index_t *index;
+    if (!open_indexed(filename, sam, index))
+        return false;
+
+    //The last contig with any reads on it is where the tail shard starts
+    //reading to the end of the file
+    const bam_header_t *header = sam->header;
+    int last = header->n_targets - 1;
+    bam1_t *b = bam_init1();
+    for ( ; last >= 0; last--) {
+        bam_iter_t iter = bam_iter_query(index, last, 0, whole_contig);
+        int ret = bam_iter_read(sam->x.bam, iter, b);
+        bam_iter_destroy(iter);
+        if (ret >= 0)
+            break;
+    }
+    bam_destroy1(b);
+
+    //Longest contigs first, each to whichever shard has the least so far
+    vector<pair<uint32_t, int> > contigs;
+    for (int tid = 0; tid < last; tid++)
+        contigs.push_back(make_pair(header->target_len[tid], tid));
+    sort(contigs.rbegin(), contigs.rend());
+
+    n = max<size_t>(1, min<size_t>(n, last + 1));
+    vector<vector<IndexRegion> > plan(n);
+    vector<uint64_t> load(n, 0);
+    if (last >= 0) {
+        plan[0].push_back(IndexRegion(last, 0, whole_contig));
+        load[0] = header->target_len[last];
+    }
+    for (size_t i = 0; i < contigs.size(); i++) {
+        size_t lightest = min_element(load.begin(), load.end()) - load.begin();
+        plan[lightest].push_back(IndexRegion(contigs[i].second, 0, whole_contig));
+        load[lightest] += contigs[i].first;
+    }
+
+    //Each shard needs its own file handle and index
+    for (size_t i = 0; i < plan.size(); i++) {
+        if (i > 0 && !open_indexed(filename, sam, index))
+            break;
+        sort(plan[i].begin(), plan[i].end());
+        shards.push_back(new IndexedInput(sam, index, plan[i], i == 0));
+    }
+    if (shards.size() < plan.size()) {
+        for (size_t i = 0; i < shards.size(); i++)
+            delete shards[i];
+        shards.clear();
+        return false;
+    }
+    return true;
+}
+
+bool open_byte_shards(const char *filename, size_t n, bool map, vector<BamInput *> &shards) {
+    if (strcmp(filename, "-") == 0 || is_big_endian() || is_cram(filename))
+        return false;
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    uint64_t size = st.st_size;
+
+    //The first shard reads the header, and starts where it ends
+    ThreadedBgzfInput *first = new ThreadedBgzfInput(filename, open(filename, O_RDONLY), 1);
+    if (map)
+        first->map_file();
+    vector<pair<uint64_t, size_t> > starts(1);
+    if (!first->read_header() || !first->position(starts[0].first, starts[0].second)) {
+        delete first;
+        close(fd);
+        return false;
+    }
+    int32_t n_targets = first->header()->n_targets;
+    shards.push_back(first);
+
+    //Then each of the others picks up at the first record it can find
+    //after its share of the file
+    for (size_t i = 1; i < n; i++) {
+        uint64_t from = max(size / n * i, starts.back().first + 1);
+        while (from < size) {
+            uint64_t block = find_block(fd, size, from);
+            vector<unsigned char> data;
+            size_t bsize = block < size ? inflate_block_at(fd, block, data) : 0;
+            if (bsize == 0 || data.empty())
+                break;
+            size_t limit = data.size();
+            uint64_t next = block + bsize;
+            for (int j = 1; j < sync_blocks && next < size; j++) {
+                size_t b = inflate_block_at(fd, next, data);
+                if (b == 0)
+                    break;
+                next += b;
+            }
+            size_t offset = find_record(data, limit, n_targets);
+            if (offset < limit) {
+                starts.push_back(make_pair(block, offset));
+                break;
+            }
+            //A record that fills the whole block; try the next one
+            from = block + bsize;
+        }
+        if (starts.size() == i)
+            break;
+    }
+    close(fd);
+
+    for (size_t i = 1; i < starts.size(); i++) {
+        ThreadedBgzfInput *shard = new ThreadedBgzfInput(filename, open(filename, O_RDONLY), 1);
+        if (map)
+            shard->map_file();
+        if (!shard->seek(starts[i].first, starts[i].second)) {
+            delete shard;
+            for (size_t j = 0; j < shards.size(); j++)
+                delete shards[j];
+            shards.clear();
+            return false;
+        }
+        static_cast<ThreadedBgzfInput *>(shards.back())->set_end(starts[i].first, starts[i].second);
+        shards.push_back(shard);
+    }
+    return true;
+}
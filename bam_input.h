@@ -0,0 +1,103 @@
+/*
+Copyright 2010, HudsonAlpha Institute for Biotechnology
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+bam_input.h
+
+Sources of BAM records for parse_bamfile
+*/
+
+#ifndef BAM2FASTQ_BAM_INPUT_H
+#define BAM2FASTQ_BAM_INPUT_H
+
+#include "sam.h"
+#include <string>
+#include <vector>
+
+//Older samtools don't know about supplementary alignments
+#ifndef BAM_FSUPPLEMENTARY
+#define BAM_FSUPPLEMENTARY 2048
+#endif
+
+class BamInput {
+public:
+    BamInput() : m_require(0), m_exclude(0), m_skipped(0) {}
+    virtual ~BamInput() {}
+    virtual bam_header_t *header() = 0;
+    //Same convention as bam_read1: bytes read on success, -1 on normal
+    //EOF and < -1 on truncation or errors
+    virtual int read(bam1_t *b) = 0;
+
+    //From then on read() passes over records that don't have all of the
+    //require flags, or that have any of the exclude flags
+    void set_flag_filter(int require, int exclude) {
+        m_require = require;
+        m_exclude = exclude;
+    }
+    //How many records read() has passed over
+    size_t skipped() const { return m_skipped; }
+
+    //Where the next record starts: the file offset of its BGZF block, and
+    //how far into the inflated block it is.  False if the input can't
+    //tell, or at EOF.
+    virtual bool position(uint64_t &, size_t &) { return false; }
+
+protected:
+    bool wanted(int flag) const {
+        return (flag & m_require) == m_require && !(flag & m_exclude);
+    }
+
+    int m_require;
+    int m_exclude;
+    size_t m_skipped;
+};
+
+//Returns NULL (after printing a message) if the file can't be opened.
+//With threads > 1, BGZF blocks are inflated on that many worker threads.
+//With map, the file is memory-mapped and the blocks are inflated straight
+//out of the mapping.  CRAM files are decoded by samtools view on that
+//many threads instead.
+BamInput *open_bam_input(const char *filename, int threads, bool map = false);
+
+//How CRAM is decoded: the samtools to run (as found on $PATH, by default
+//"samtools"), and the reference FASTA to pass it with -T, or NULL to have
+//it look the reference up through REF_PATH and REF_CACHE
+void set_cram_decoder(const char *samtools, const char *reference);
+
+//Whether open_bam_input would decode filename as CRAM
+bool is_cram_input(const char *filename);
+
+//The same, but starting with the record at a position() an earlier
+//input of the same file gave
+BamInput *open_bam_input_at(const char *filename, int threads, bool map, uint64_t block,
+                            size_t offset);
+
+//Only the reads overlapping the given samtools-style regions
+//(chr, chr:start or chr:start-end), using the BAM's .bai index.  A read
+//overlapping more than one of them is only returned the first time.
+BamInput *open_region_input(const char *filename, const std::vector<std::string> &regions);
+
+//Splits an indexed BAM into at most n inputs, each made up of whole
+//contigs, for reading in parallel.  The first one also gets the unmapped
+//reads at the end of the file.  Returns false if there's no index.
+bool open_contig_shards(const char *filename, size_t n, std::vector<BamInput *> &shards);
+
+//Splits a BAM into at most n inputs covering consecutive stretches of the
+//file, for reading in parallel without an index.  Each one after the first
+//starts at what looks like the first record after a BGZF block boundary,
+//and the one before it checks that it ends exactly there.  Returns false
+//if the file can't be split (it's a pipe, say).
+bool open_byte_shards(const char *filename, size_t n, bool map, std::vector<BamInput *> &shards);
+
+#endif
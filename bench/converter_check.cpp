@@ -0,0 +1,214 @@
+/*
+Copyright 2010, HudsonAlpha Institute for Biotechnology
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+converter_check.cpp
+
+Writes a small BAM with its mates out of order, a read on its own and two
+reads whose mates never turn up, and checks what a Converter makes of it
+*/
+
+#include "sam.h"
+#include "converter.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+namespace {
+
+//A read as it should come out: the name the pair is matched on, and the
+//sequence and qualities in FASTQ orientation
+struct Read {
+    const char *name;
+    const char *key;
+    int flag;
+    const char *seq;
+    const char *qual;
+};
+
+const int paired1 = BAM_FPAIRED | BAM_FUNMAP | BAM_FMUNMAP | BAM_FREAD1;
+const int paired2 = BAM_FPAIRED | BAM_FUNMAP | BAM_FMUNMAP | BAM_FREAD2;
+
+//In file order.  pairA's read 2 comes before its read 1, pairB's reads are
+//apart and read 2 is on the reverse strand, and the lost reads' mates
+//aren't in the file at all.
+const Read reads[] = {
+    { "pairA/2", "pairA", paired2, "TTGCA", "#$%&'" },
+    { "alone", "alone", BAM_FUNMAP, "ACGTNA", "!!IIJJ" },
+    { "pairA/1", "pairA", paired1, "ACGTAC", "56789:" },
+    { "pairB", "pairB", paired1, "GGGCC", "?@ABC" },
+    { "lostA/2", "lostA", paired2, "CATCA", "+++++" },
+    { "pairB", "pairB", paired2 | BAM_FREVERSE, "AACGTT", "012345" },
+    { "lostB/1", "lostB", paired1, "NNAC", "~~~~" },
+};
+const int read_count = sizeof(reads) / sizeof(reads[0]);
+
+int failures = 0;
+
+void fail(const string &what) {
+    cerr << "FAIL: " << what << endl;
+    failures++;
+}
+
+uint8_t code(char base) {
+    switch (base) {
+        case 'A' : return 1;
+        case 'C' : return 2;
+        case 'G' : return 4;
+        case 'T' : return 8;
+        default : return 15;
+    }
+}
+
+char complement(char base) {
+    switch (base) {
+        case 'A' : return 'T';
+        case 'C' : return 'G';
+        case 'G' : return 'C';
+        case 'T' : return 'A';
+        default : return 'N';
+    }
+}
+
+//Stored the way an aligner would, reverse complemented for BAM_FREVERSE
+bam1_t *make_read(const Read &r) {
+    string seq(r.seq);
+    string qual(r.qual);
+    if (r.flag & BAM_FREVERSE) {
+        seq.assign(seq.rbegin(), seq.rend());
+        for (size_t i = 0; i < seq.size(); i++)
+            seq[i] = complement(seq[i]);
+        qual.assign(qual.rbegin(), qual.rend());
+    }
+    int length = seq.size();
+    bam1_t *b = bam_init1();
+    bam1_core_t &c = b->core;
+    c.tid = c.pos = c.mtid = c.mpos = -1;
+    c.l_qname = strlen(r.name) + 1;
+    c.flag = r.flag;
+    c.l_qseq = length;
+    c.bin = 4680;
+    b->data_len = c.l_qname + (length + 1) / 2 + length;
+    b->m_data = b->data_len;
+    b->data = static_cast<uint8_t *>(malloc(b->m_data));
+    uint8_t *p = b->data;
+    memcpy(p, r.name, c.l_qname);
+    p += c.l_qname;
+    for (int i = 0; i < length; i += 2)
+        *p++ = code(seq[i]) << 4 | (i + 1 < length ? code(seq[i+1]) : 0);
+    for (int i = 0; i < length; i++)
+        *p++ = qual[i] - 33;
+    b->l_aux = 0;
+    return b;
+}
+
+bool write_bam(const char *path) {
+    bamFile out = bam_open(path, "w");
+    if (out == NULL) {
+        cerr << "Could not create " << path << endl;
+        return false;
+    }
+    bam_header_t *header = bam_header_init();
+    header->text = strdup("@HD\tVN:1.0\tSO:unsorted\n");
+    header->l_text = strlen(header->text);
+    bam_header_write(out, header);
+    for (int i = 0; i < read_count; i++) {
+        bam1_t *b = make_read(reads[i]);
+        bam_write1(out, b);
+        bam_destroy1(b);
+    }
+    bam_header_destroy(header);
+    bam_close(out);
+    return true;
+}
+
+const Read *find(const char *key, int mate) {
+    for (int i = 0; i < read_count; i++) {
+        const Read &r = reads[i];
+        int r_mate = !(r.flag & BAM_FPAIRED) ? 0 : (r.flag & BAM_FREAD1) ? 1 : 2;
+        if (strcmp(r.key, key) == 0 && r_mate == mate)
+            return &r;
+    }
+    return NULL;
+}
+
+//mate is what the view should say, and r_mate which read it should be
+void check(const FastqView &v, const char *key, int mate, int r_mate) {
+    const Read *r = find(key, r_mate);
+    string name(v.name, v.name_length);
+    string seq(v.seq, v.length);
+    string qual(v.qual, v.length);
+    if (name != key)
+        fail("expected " + string(key) + ", got " + name);
+    else if (v.mate != mate)
+        fail(name + " came out as the wrong mate");
+    else if (seq != r->seq || qual != r->qual)
+        fail(name + " came out as " + seq + " " + qual + " rather than " +
+             r->seq + " " + r->qual);
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        cerr << "Usage: converter_check <scratch.bam>" << endl;
+        return 2;
+    }
+    if (!write_bam(argv[1]))
+        return 1;
+
+    Converter converter;
+    if (!converter.open(argv[1]))
+        return 1;
+    FastqView first, second;
+    int pairs = 0, singles = 0;
+    bool lost[2] = { false, false };
+    while (converter.next(first, second)) {
+        //The read on its own as it turns up, each pair once its second read
+        //does, then the reads left waiting
+        if (second.mate) {
+            const char *key = pairs == 0 ? "pairA" : "pairB";
+            check(first, key, 1, 1);
+            check(second, key, 2, 2);
+            if (singles != 1)
+                fail("a pair came out before the read on its own");
+            pairs++;
+        } else if (singles == 0) {
+            check(first, "alone", 0, 0);
+            singles++;
+        } else {
+            if (pairs != 2)
+                fail("a leftover came out before the pairs were done");
+            string name(first.name, first.name_length);
+            int which = name == "lostA" ? 0 : 1;
+            if (lost[which])
+                fail(name + " came out twice");
+            lost[which] = true;
+            check(first, which == 0 ? "lostA" : "lostB", 0, which == 0 ? 2 : 1);
+            singles++;
+        }
+    }
+    if (!converter.ok())
+        fail("the converter didn't read to the end of the file");
+    if (pairs != 2 || singles != 3)
+        fail("expected 2 pairs and 3 single reads");
+    if (failures)
+        return 1;
+    cout << "Converter: " << pairs << " pairs and " << singles << " single reads as expected" << endl;
+    return 0;
+}
@@ -0,0 +1,131 @@
+/*
+Copyright 2010, HudsonAlpha Institute for Biotechnology
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+kernels.cpp
+
+Microbenchmarks of the per-read work for make bench: decoding sequences
+and qualities, formatting whole FASTQ records and matching mates
+*/
+
+#include "sam.h"
+#include "decode.h"
+#include "pair_table.h"
+#include <time.h>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+namespace {
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//Half of them reversed, so both strands get timed
+vector<bam1_t *> make_reads(size_t count, int length) {
+    vector<bam1_t *> reads;
+    for (size_t i = 0; i < count; i++) {
+        bam1_t *b = bam_init1();
+        char name[64];
+        int name_length = sprintf(name, "SYN:1:1:%010lu:%d", (unsigned long)(i / 2), int(i % 9973));
+        b->core.l_qname = name_length + 1;
+        b->core.l_qseq = length;
+        b->core.flag = BAM_FPAIRED | (i & 1 ? BAM_FREAD2 | BAM_FREVERSE : BAM_FREAD1);
+        b->data_len = b->core.l_qname + (length + 1) / 2 + length;
+        b->m_data = b->data_len;
+        b->data = static_cast<uint8_t *>(malloc(b->m_data));
+        memcpy(b->data, name, b->core.l_qname);
+        uint8_t *p = bam1_seq(b);
+        for (int j = 0; j < (length + 1) / 2; j++)
+            p[j] = rand();
+        p = bam1_qual(b);
+        for (int j = 0; j < length; j++)
+            p[j] = 2 + rand() % 39;
+        reads.push_back(b);
+    }
+    return reads;
+}
+
+void report(const char *what, size_t records, size_t bytes, double seconds) {
+    cout << left << setw(22) << what << right << fixed << setprecision(0)
+         << setw(12) << records / seconds << " records/s";
+    if (bytes > 0)
+        cout << setw(10) << bytes / seconds / (1 << 20) << " MB/s";
+    cout << endl;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+    int length = argc > 2 ? atoi(argv[2]) : 100;
+    const int rounds = 5;
+    init_decode_tables();
+    vector<bam1_t *> reads = make_reads(count, length);
+    FastqFormat format;
+    RecordTags none;
+    find_tags(reads[0], format, none);
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++)
+        total += fastq_length(reads[i], strlen(bam1_qname(reads[i])), format, none);
+    vector<char> buffer(total);
+
+    double start = now();
+    for (int r = 0; r < rounds; r++)
+        for (size_t i = 0; i < count; i++)
+            decode_sequence(reads[i], &buffer[0]);
+    report("decode_sequence", rounds * count, rounds * count * length, now() - start);
+
+    start = now();
+    for (int r = 0; r < rounds; r++)
+        for (size_t i = 0; i < count; i++)
+            decode_qualities(reads[i], &buffer[0], 33);
+    report("decode_qualities", rounds * count, rounds * count * length, now() - start);
+
+    start = now();
+    for (int r = 0; r < rounds; r++) {
+        char *p = &buffer[0];
+        for (size_t i = 0; i < count; i++)
+            p = format_fastq(reads[i], strlen(bam1_qname(reads[i])), format, none, p);
+    }
+    report("format_fastq", rounds * count, rounds * total, now() - start);
+
+    //All the first reads, then all the second ones, so the table fills up
+    //to count / 2 before it empties again
+    start = now();
+    for (int r = 0; r < rounds; r++) {
+        PairTable table;
+        bam1_t mate;
+        for (size_t n = 0; n < count; n++) {
+            size_t i = n < (count + 1) / 2 ? 2 * n : 2 * (n - (count + 1) / 2) + 1;
+            const char *key = bam1_qname(reads[i]);
+            size_t key_length = strlen(key);
+            uint64_t hash = PairTable::hash(key, key_length);
+            if (!table.take(key, key_length, hash, &mate))
+                table.insert(key_length, hash, reads[i]);
+        }
+    }
+    report("pair matching", rounds * count, 0, now() - start);
+
+    for (size_t i = 0; i < count; i++)
+        bam_destroy1(reads[i]);
+    return 0;
+}
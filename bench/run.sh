@@ -0,0 +1,40 @@
+#!/bin/sh
+# Run by make bench: the kernel microbenchmarks, then bam2fastq end to end
+# over a few synthetic BAMs, with records/s, peak RSS and the most reads
+# waiting for their mates at once from --stats=json.
+# The BAMs are kept in $BENCH_DIR (bench/data) for next time.
+
+reads=${1:-1000000}
+threads=${2:-4}
+dir=${BENCH_DIR:-bench/data}
+mkdir -p "$dir" || exit 1
+
+echo "== Kernels"
+bench/kernels 200000 100 || exit 1
+
+# name, then synth_bam options
+generate() {
+    name=$1
+    shift
+    [ -f "$dir/$name-$reads.bam" ] || bench/synth_bam -n "$reads" "$@" "$dir/$name-$reads.bam" || exit 1
+}
+
+field() {
+    echo "$2" | sed -e "s/.*\"$1\": \([0-9.]*\).*/\1/"
+}
+
+generate coord-100
+generate name-100 -O name
+generate unaligned-250 -l 250 -a 0.2
+generate single-150 -S -l 150
+
+echo "== End to end, $reads reads"
+for name in coord-100 name-100 unaligned-250 single-150; do
+    for t in 1 "$threads"; do
+        stats=`./bam2fastq -q -f -t "$t" --stats=json -o "$dir/out#" "$dir/$name-$reads.bam" 2>&1 | tail -1`
+        printf "%-16s -t %-3s %10.0f records/s %8s K peak RSS %8s waiting\n" "$name" "$t" \
+            "`field records_per_second "$stats"`" "`field max_rss_kb "$stats"`" \
+            "`field pair_table_peak_reads "$stats"`"
+    done
+done
+rm -f "$dir/out_1" "$dir/out_2" "$dir/out_M"
@@ -0,0 +1,240 @@
+/*
+Copyright 2010, HudsonAlpha Institute for Biotechnology
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+synth_bam.cpp
+
+Writes a synthetic BAM file for make bench, with the read length, pairing,
+sort order, aligned fraction and reverse-strand fraction under control
+*/
+
+#include "sam.h"
+#include <getopt.h>
+#include <iostream>
+#include <queue>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+namespace {
+
+size_t reads = 1000000;
+int read_length = 100;
+int single = 0;
+const char *order = "coord";
+double aligned = 0.9;
+double reverse = 0.5;
+//How much further than the insert size read 2 may land from read 1, so
+//that coordinate order holds reads back waiting for their mates
+int mate_window = 10000000;
+
+const int contigs = 24;
+const uint32_t contig_length = 100000000;
+const int insert_size = 400;
+
+void usage() {
+    cerr << "Usage: synth_bam [options] <out.bam>" << endl
+         << "  -n N           reads (pairs count as two) [1000000]" << endl
+         << "  -l N           read length [100]" << endl
+         << "  -S             single-end reads" << endl
+         << "  -O ORDER       name or coord [coord]" << endl
+         << "  -a FRACTION    aligned fraction [0.9]" << endl
+         << "  -r FRACTION    reverse-strand fraction of the aligned reads [0.5]" << endl
+         << "  -w BASES       scatter read 2 up to BASES beyond the insert size [10000000]" << endl
+         << "  -s SEED        random seed [1]" << endl;
+    exit(2);
+}
+
+double uniform() {
+    return rand() / (RAND_MAX + 1.0);
+}
+
+//A read that hasn't been written yet, for coordinate order
+struct Pending {
+    Pending(bam1_t *b) : read(b) {}
+    bool operator<(const Pending &other) const {
+        return read->core.pos > other.read->core.pos;
+    }
+    bam1_t *read;
+};
+
+bam1_t *make_read(size_t fragment, int flag, int tid, int pos, int mtid, int mpos) {
+    bam1_t *b = bam_init1();
+    char name[64];
+    //Zero-padded, so fragment order is name order too
+    int name_length = sprintf(name, "SYN:1:1:%010lu:%d", (unsigned long)fragment,
+                              int(fragment % 9973));
+    bool mapped = !(flag & BAM_FUNMAP);
+    bam1_core_t &c = b->core;
+    c.tid = mapped ? tid : -1;
+    c.pos = mapped ? pos : -1;
+    c.qual = mapped ? 60 : 0;
+    c.l_qname = name_length + 1;
+    c.flag = flag;
+    c.n_cigar = mapped ? 1 : 0;
+    c.l_qseq = read_length;
+    c.mtid = mtid;
+    c.mpos = mpos;
+    c.bin = mapped ? bam_reg2bin(pos, pos + read_length) : 4680;
+
+    b->data_len = c.l_qname + 4 * c.n_cigar + (read_length + 1) / 2 + read_length;
+    b->m_data = b->data_len;
+    b->data = static_cast<uint8_t *>(malloc(b->m_data));
+    uint8_t *p = b->data;
+    memcpy(p, name, c.l_qname);
+    p += c.l_qname;
+    if (mapped) {
+        uint32_t cigar = read_length << BAM_CIGAR_SHIFT | BAM_CMATCH;
+        memcpy(p, &cigar, 4);
+        p += 4;
+    }
+    //A, C, G and T are 1, 2, 4 and 8; an N now and then
+    static const uint8_t codes[] = { 1, 2, 4, 8, 1, 2, 4, 8, 1, 2, 4, 8, 1, 2, 4, 15 };
+    for (int i = 0; i < read_length; i += 2) {
+        uint8_t hi = codes[rand() & 15];
+        uint8_t lo = i + 1 < read_length ? codes[rand() & 15] : 0;
+        *p++ = hi << 4 | lo;
+    }
+    for (int i = 0; i < read_length; i++)
+        *p++ = 2 + rand() % 39;
+    b->l_aux = 0;
+    return b;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    srand(1);
+    int ch;
+    while ((ch = getopt(argc, argv, "n:l:SO:a:r:w:s:")) != -1)
+        switch (ch) {
+            case 'n' : reads = strtoul(optarg, NULL, 10); break;
+            case 'l' : read_length = atoi(optarg); break;
+            case 'S' : single = 1; break;
+            case 'O' : order = optarg; break;
+            case 'a' : aligned = atof(optarg); break;
+            case 'r' : reverse = atof(optarg); break;
+            case 'w' : mate_window = atoi(optarg); break;
+            case 's' : srand(atoi(optarg)); break;
+            default : usage();
+        }
+    bool by_name = strcmp(order, "name") == 0;
+    if (optind + 1 != argc || read_length < 1 || mate_window < 0 ||
+            (!by_name && strcmp(order, "coord") != 0))
+        usage();
+
+    bamFile out = bam_open(argv[optind], "w");
+    if (out == NULL) {
+        cerr << "Could not create " << argv[optind] << endl;
+        return 1;
+    }
+    bam_header_t *header = bam_header_init();
+    char text[128];
+    sprintf(text, "@HD\tVN:1.0\tSO:%s\n", by_name ? "queryname" : "coordinate");
+    header->l_text = strlen(text);
+    header->text = strdup(text);
+    header->n_targets = contigs;
+    header->target_name = static_cast<char **>(malloc(contigs * sizeof(char *)));
+    header->target_len = static_cast<uint32_t *>(malloc(contigs * sizeof(uint32_t)));
+    for (int i = 0; i < contigs; i++) {
+        char name[16];
+        sprintf(name, "chr%d", i + 1);
+        header->target_name[i] = strdup(name);
+        header->target_len[i] = contig_length;
+    }
+    bam_header_write(out, header);
+
+    //Fragments are laid out along the genome in order, so for coordinate
+    //order only the mates that haven't come up yet need holding back.
+    //Fragments are thousands of bases apart, so without -w every read 2
+    //would come right after its read 1.
+    //Unaligned fragments go at the end, as they would after sorting.
+    priority_queue<Pending> pending;
+    vector<size_t> unaligned;
+    int per_read = single ? 1 : 2;
+    size_t fragments = reads / per_read;
+    double step = double(contigs) * (contig_length - insert_size) / max<size_t>(fragments, 1);
+    int tid = -1;
+    for (size_t f = 0; f < fragments; f++) {
+        double where = f * step;
+        int t = int(where / (contig_length - insert_size));
+        int pos = int(where - t * double(contig_length - insert_size));
+        if (t != tid) {
+            while (!pending.empty()) {
+                bam_write1(out, pending.top().read);
+                bam_destroy1(pending.top().read);
+                pending.pop();
+            }
+            tid = t;
+        }
+        bool mapped = uniform() < aligned;
+        if (!mapped && !by_name) {
+            unaligned.push_back(f);
+            continue;
+        }
+        bool rev = mapped && uniform() < reverse;
+        int mpos = pos + insert_size - read_length + int(uniform() * mate_window);
+        if (mpos > int(contig_length) - read_length)
+            mpos = contig_length - read_length;
+        if (single) {
+            bam1_t *b = make_read(f, mapped ? (rev ? BAM_FREVERSE : 0) : BAM_FUNMAP,
+                                 t, pos, -1, -1);
+            bam_write1(out, b);
+            bam_destroy1(b);
+            continue;
+        }
+        int flags = BAM_FPAIRED | (mapped ? BAM_FPROPER_PAIR : BAM_FUNMAP | BAM_FMUNMAP);
+        bam1_t *first = make_read(f, flags | BAM_FREAD1 | (rev ? BAM_FREVERSE : BAM_FMREVERSE),
+                                  t, pos, mapped ? t : -1, mapped ? mpos : -1);
+        bam1_t *second = make_read(f, flags | BAM_FREAD2 | (rev ? BAM_FMREVERSE : BAM_FREVERSE),
+                                   t, mpos, mapped ? t : -1, mapped ? pos : -1);
+        if (by_name) {
+            bam_write1(out, first);
+            bam_write1(out, second);
+            bam_destroy1(first);
+            bam_destroy1(second);
+            continue;
+        }
+        while (!pending.empty() && pending.top().read->core.pos <= pos) {
+            bam_write1(out, pending.top().read);
+            bam_destroy1(pending.top().read);
+            pending.pop();
+        }
+        bam_write1(out, first);
+        bam_destroy1(first);
+        pending.push(Pending(second));
+    }
+    while (!pending.empty()) {
+        bam_write1(out, pending.top().read);
+        bam_destroy1(pending.top().read);
+        pending.pop();
+    }
+    if (!by_name) {
+        for (size_t i = 0; i < unaligned.size(); i++) {
+            size_t f = unaligned[i];
+            for (int r = 0; r < per_read; r++) {
+                int flag = BAM_FUNMAP | (single ? 0 : BAM_FPAIRED | BAM_FMUNMAP |
+                                         (r ? BAM_FREAD2 : BAM_FREAD1));
+                bam1_t *b = make_read(f, flag, -1, -1, -1, -1);
+                bam_write1(out, b);
+                bam_destroy1(b);
+            }
+        }
+    }
+    bam_close(out);
+    bam_header_destroy(header);
+    return 0;
+}
@@ -0,0 +1,164 @@
+/*
+Copyright 2010, HudsonAlpha Institute for Biotechnology
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+checkpoint.cpp
+
+The state --checkpoint saves and --resume picks up from
+*/
+
+#include "checkpoint.h"
+#include "pair_table.h"
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+namespace {
+
+//The first line of every checkpoint
+const char checkpoint_magic[] = "bam2fastq checkpoint 1";
+
+//Up to the newline, which isn't kept.  False at EOF.
+bool read_line(FILE *file, string &line) {
+    line.clear();
+    int c;
+    while ((c = getc(file)) != EOF && c != '\n')
+        line += static_cast<char>(c);
+    return c != EOF || !line.empty();
+}
+
+//Whatever follows the first count fields of line
+string rest_of(const string &line, int count) {
+    size_t at = 0;
+    for (int i = 0; i < count && at != string::npos; i++) {
+        at = line.find(' ', at);
+        if (at != string::npos)
+            at++;
+    }
+    return at == string::npos ? "" : line.substr(at);
+}
+
+bool read_text(FILE *file, string &text, size_t length) {
+    text.resize(length);
+    return length == 0 || fread(&text[0], 1, length, file) == length;
+}
+
+}
+
+Checkpoint::~Checkpoint() {
+    for (size_t i = 0; i < pending.size(); i++)
+        bam_destroy1(pending[i]);
+}
+
+//Text lines, then the raw bytes of the waiting read and the pending ones
+bool Checkpoint::save(const string &path, const vector<bam1_t> &pending_reads) const {
+    string temp = path + ".tmp";
+    FILE *file = fopen(temp.c_str(), "wb");
+    if (file == NULL) {
+        cerr << "ERROR: could not create " << temp << ": " << strerror(errno) << endl;
+        return false;
+    }
+    fprintf(file, "%s\n", checkpoint_magic);
+    fprintf(file, "input %s\n", input.c_str());
+    fprintf(file, "position %llu %lu\n", (unsigned long long)block, (unsigned long)offset);
+    fprintf(file, "reads %lu %lu\n", (unsigned long)seen, (unsigned long)exported);
+    for (size_t i = 0; i < files.size(); i++)
+        fprintf(file, "file %llu %s\n", (unsigned long long)files[i].second, files[i].first.c_str());
+    for (size_t i = 0; i < groups.size(); i++)
+        fprintf(file, "group %d %d %lu %llu %llu %s\n", groups[i].lane, groups[i].group,
+                (unsigned long)groups[i].chunk, (unsigned long long)groups[i].reads,
+                (unsigned long long)groups[i].bytes, groups[i].group_id.c_str());
+    if (waiting) {
+        fprintf(file, "waiting %d %d %d %lu %lu %s\n", waiting_idx, waiting_lane, waiting_group,
+                (unsigned long)waiting_key.size(), (unsigned long)waiting_text.size(),
+                waiting_group_id.c_str());
+        fwrite(waiting_key.data(), 1, waiting_key.size(), file);
+        fwrite(waiting_text.data(), 1, waiting_text.size(), file);
+    }
+    fprintf(file, "pending %lu\n", (unsigned long)pending_reads.size());
+    bool ok = true;
+    for (size_t i = 0; i < pending_reads.size() && ok; i++)
+        ok = write_record(file, &pending_reads[i]);
+    fprintf(file, "end\n");
+    ok = fflush(file) == 0 && fsync(fileno(file)) == 0 && ok;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+        cerr << "ERROR: could not write " << path << ": " << strerror(errno) << endl;
+        unlink(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool Checkpoint::load(const string &path) {
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == NULL) {
+        cerr << "ERROR: could not open " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+    string line;
+    bool ok = read_line(file, line) && line == checkpoint_magic;
+    bool ended = false;
+    while (ok && !ended && read_line(file, line)) {
+        istringstream fields(line);
+        string kind;
+        fields >> kind;
+        if (kind == "input") {
+            input = rest_of(line, 1);
+        } else if (kind == "position") {
+            ok = static_cast<bool>(fields >> block >> offset);
+        } else if (kind == "reads") {
+            ok = static_cast<bool>(fields >> seen >> exported);
+        } else if (kind == "file") {
+            uint64_t size;
+            ok = static_cast<bool>(fields >> size);
+            files.push_back(make_pair(rest_of(line, 2), size));
+        } else if (kind == "group") {
+            OutputSet set;
+            ok = static_cast<bool>(fields >> set.lane >> set.group >> set.chunk >> set.reads
+                                          >> set.bytes);
+            set.group_id = rest_of(line, 6);
+            groups.push_back(set);
+        } else if (kind == "waiting") {
+            size_t key_length, text_length;
+            ok = fields >> waiting_idx >> waiting_lane >> waiting_group >> key_length >> text_length
+                && read_text(file, waiting_key, key_length)
+                && read_text(file, waiting_text, text_length);
+            waiting_group_id = rest_of(line, 6);
+            waiting = true;
+        } else if (kind == "pending") {
+            size_t count;
+            ok = static_cast<bool>(fields >> count);
+            for (size_t i = 0; i < count && ok; i++) {
+                pending.push_back(bam_init1());
+                ok = read_record(file, pending.back());
+            }
+        } else if (kind == "end") {
+            ended = true;
+        } else {
+            ok = false;
+        }
+    }
+    fclose(file);
+    if (!ok || !ended) {
+        cerr << "ERROR: " << path << " is not a bam2fastq checkpoint, or is damaged" << endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,92 @@
+/*
+Copyright 2010, HudsonAlpha Institute for Biotechnology
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+checkpoint.h
+
+The state --checkpoint saves and --resume picks up from
+*/
+
+#ifndef BAM2FASTQ_CHECKPOINT_H
+#define BAM2FASTQ_CHECKPOINT_H
+
+#include "sam.h"
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+//Everything needed to carry on converting a BAM from part of the way
+//through it.  The outputs were synced when it was taken, so cutting them
+//back to the sizes here leaves exactly what the reads before the position
+//made of them.
+struct Checkpoint {
+    Checkpoint() : block(0), offset(0), seen(0), exported(0), waiting(false), waiting_idx(0),
+                   waiting_lane(0), waiting_group(0) {}
+    ~Checkpoint();
+
+    std::string input;
+    //Where the first record that hasn't been dealt with starts
+    uint64_t block;
+    size_t offset;
+    //Records read from the input so far, and how many were exported
+    size_t seen;
+    size_t exported;
+
+    //Every output file created so far, and how big it was
+    std::vector<std::pair<std::string, uint64_t> > files;
+    //Each set of split output files created so far, so they're appended
+    //to rather than started again
+    struct OutputSet {
+        OutputSet() : lane(0), group(0), chunk(0), reads(0), bytes(0) {}
+        int lane;
+        //An OutputKey group.  Read groups that aren't in the header are
+        //numbered as they turn up, so a number is only good for the run
+        //that saved it; group_id is what says which one it was.
+        int group;
+        std::string group_id;
+        //With --split-reads or --split-bytes, which chunk the files are
+        //for, and how much has gone into it
+        size_t chunk;
+        uint64_t reads;
+        uint64_t bytes;
+    };
+    std::vector<OutputSet> groups;
+
+    //A collated read waiting for its mate, already formatted
+    bool waiting;
+    int waiting_idx;
+    int waiting_lane;
+    int waiting_group;
+    std::string waiting_group_id;
+    std::string waiting_key;
+    std::string waiting_text;
+
+    //Reads waiting for their mates in the pair table, after load().  The
+    //checkpoint owns them.
+    std::vector<bam1_t *> pending;
+
+    //Writes the checkpoint, with pending_reads as the pending ones, next
+    //to path and then renames it into place, so a whole one is always
+    //there.  False (after a message) if it can't.
+    bool save(const std::string &path, const std::vector<bam1_t> &pending_reads) const;
+    //False (after a message) if path isn't a whole checkpoint
+    bool load(const std::string &path);
+
+private:
+    Checkpoint(const Checkpoint &);
+    Checkpoint &operator=(const Checkpoint &);
+};
+
+#endif
@@ -0,0 +1,108 @@
+/*
+Copyright 2010, HudsonAlpha Institute for Biotechnology
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+converter.cpp
+
+bam2fastq as a library: reads come out of a Converter as pairs of
+decoded (name, sequence, qualities) views rather than FASTQ text
+*/
+
+#include "converter.h"
+#include "bam_input.h"
+#include "decode.h"
+
+using namespace std;
+
+Converter::Converter(const ConverterOptions &options)
+    : m_options(options), m_input(NULL), m_read(bam_init1()), m_next_leftover(0),
+      m_reading(false), m_ok(true) {
+    init_decode_tables();
+}
+
+Converter::~Converter() {
+    delete m_input;
+    bam_destroy1(m_read);
+}
+
+bool Converter::open(const char *filename) {
+    if (m_input)
+        return false;
+    m_input = open_bam_input(filename, m_options.threads);
+    if (m_input == NULL)
+        return false;
+
+    int require = m_options.require_flags;
+    int exclude = m_options.exclude_flags;
+    if (!m_options.aligned)
+        require |= BAM_FUNMAP;
+    if (!m_options.unaligned)
+        exclude |= BAM_FUNMAP;
+    if (!m_options.filtered)
+        exclude |= BAM_FQCFAIL;
+    if (!m_options.secondary)
+        exclude |= BAM_FSECONDARY | BAM_FSUPPLEMENTARY;
+    m_input->set_flag_filter(require, exclude);
+    m_reading = true;
+    return true;
+}
+
+//The buffer holds the sequence, then the qualities
+void Converter::view(const bam1_t *b, FastqView &v, vector<char> &buffer) const {
+    size_t length = b->core.l_qseq;
+    if (buffer.size() < 2 * length + 1)
+        buffer.resize(2 * length + 1);
+    decode_sequence(b, &buffer[0]);
+    decode_qualities(b, &buffer[length], m_options.quality_offset);
+    v.name = bam1_qname(b);
+    v.name_length = (b->core.flag & BAM_FPAIRED) && !m_options.strict
+        ? pair_key_length<false>(b) : strlen(v.name);
+    v.seq = &buffer[0];
+    v.qual = &buffer[length];
+    v.length = length;
+    v.mate = !(b->core.flag & BAM_FPAIRED) ? 0 : (b->core.flag & BAM_FREAD1) ? 1 : 2;
+}
+
+bool Converter::next(FastqView &first, FastqView &second) {
+    second.mate = 0;
+    while (m_reading) {
+        int ret = m_input->read(m_read);
+        if (ret <= 0) {
+            m_ok = ret == -1;
+            m_reading = false;
+            m_table.remaining(m_leftovers);
+            break;
+        }
+        if (!(m_read->core.flag & BAM_FPAIRED)) {
+            view(m_read, first, m_first);
+            return true;
+        }
+        const char *name = bam1_qname(m_read);
+        size_t key_length = m_options.strict ? pair_key_length<true>(m_read)
+                                             : pair_key_length<false>(m_read);
+        uint64_t hash = PairTable::hash(name, key_length);
+        if (!m_table.take(name, key_length, hash, &m_mate)) {
+            m_table.insert(key_length, hash, m_read);
+            continue;
+        }
+        bool read1 = m_read->core.flag & BAM_FREAD1;
+        view(read1 ? m_read : &m_mate, first, m_first);
+        view(read1 ? &m_mate : m_read, second, m_second);
+        return true;
+    }
+    if (m_next_leftover == m_leftovers.size())
+        return false;
+    view(&m_leftovers[m_next_leftover++], first, m_first);
+    first.mate = 0;
+    return true;
+}
@@ -0,0 +1,107 @@
+/*
+Copyright 2010, HudsonAlpha Institute for Biotechnology
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+converter.h
+
+bam2fastq as a library: reads come out of a Converter as pairs of
+decoded (name, sequence, qualities) views rather than FASTQ text
+*/
+
+#ifndef BAM2FASTQ_CONVERTER_H
+#define BAM2FASTQ_CONVERTER_H
+
+#include "sam.h"
+#include "pair_table.h"
+#include <cstddef>
+#include <vector>
+
+class BamInput;
+
+//The same choices as the command line options of the same names
+struct ConverterOptions {
+    ConverterOptions()
+        : aligned(true), unaligned(true), filtered(true), secondary(false), strict(false),
+          require_flags(0), exclude_flags(0), quality_offset(33), threads(1) {}
+
+    bool aligned;
+    bool unaligned;
+    bool filtered;
+    bool secondary;
+    bool strict;
+    int require_flags;
+    int exclude_flags;
+    int quality_offset;
+    //For inflating BGZF blocks
+    int threads;
+};
+
+//One read.  name points into the Converter's copy of the record, and seq
+//and qual into its decoding buffers, so they're only good until the next
+//call to next().  Nothing is NUL-terminated; seq and qual are length long.
+struct FastqView {
+    const char *name;
+    size_t name_length;
+    const char *seq;
+    const char *qual;
+    size_t length;
+    //1 or 2 for the reads of a pair, 0 for a read on its own
+    int mate;
+};
+
+//Pairs reads up the way bam2fastq does for unsorted input: mates are held
+//(without their cigars and tags) until the other one turns up, and any
+//left over at the end come out on their own.
+//
+//    Converter converter(options);
+//    if (!converter.open("in.bam"))
+//        ...
+//    FastqView first, second;
+//    while (converter.next(first, second))
+//        if (second.mate) ... else ...
+class Converter {
+public:
+    explicit Converter(const ConverterOptions &options = ConverterOptions());
+    ~Converter();
+
+    //Returns false (after printing a message) if the file can't be read.
+    //A converter can only have one file open.
+    bool open(const char *filename);
+
+    //The next pair, with read 1 in first, or the next read on its own in
+    //first (and second.mate 0).  Returns false at the end of the file.
+    bool next(FastqView &first, FastqView &second);
+
+    //False if the file ended early or was corrupt
+    bool ok() const { return m_ok; }
+
+private:
+    Converter(const Converter &);
+    Converter &operator=(const Converter &);
+
+    void view(const bam1_t *b, FastqView &v, std::vector<char> &buffer) const;
+
+    ConverterOptions m_options;
+    BamInput *m_input;
+    bam1_t *m_read;
+    bam1_t m_mate;
+    PairTable m_table;
+    std::vector<bam1_t> m_leftovers;
+    size_t m_next_leftover;
+    bool m_reading;
+    bool m_ok;
+    std::vector<char> m_first;
+    std::vector<char> m_second;
+};
+
+#endif
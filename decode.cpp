@@ -0,0 +1,420 @@
+/*
+Copyright 2010, HudsonAlpha Institute for Biotechnology
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+decode.cpp
+
+Turns packed BAM sequences and qualities into FASTQ text
+*/
+
+#include "decode.h"
+#include <cstdio>
+#include <cstring>
+
+//SSE2 is always there on x86-64; AVX2 needs something like -march=native
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+//Each packed sequence byte holds two bases, so decode them in pairs.
+//base_pairs[x] is the two bases of byte x in order; complement_pairs[x]
+//is their complements the other way round, for reading a BAM_FREVERSE
+//read from the end.
+char base_pairs[256][2];
+char complement_pairs[256][2];
+
+const unsigned char max_quality = '~';
+
+//Worked out in int, so 0xff (no qualities) is capped rather than wrapping
+//round; the vector versions saturate for the same reason
+inline char quality_char(uint8_t q, int offset) {
+    int c = q + offset;
+    return c > max_quality ? max_quality : c;
+}
+
+#if defined(__AVX2__)
+
+const size_t vector_width = 32;
+
+inline __m256i quality_chars(const uint8_t *qual, __m256i offset, __m256i cap) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(qual));
+    return _mm256_min_epu8(_mm256_adds_epu8(v, offset), cap);
+}
+
+//Converts vector_width qualities at a time; returns how many it did
+template<bool reverse>
+size_t decode_qualities_simd(const uint8_t *qual, size_t len, char *dest, int offset) {
+    const __m256i off = _mm256_set1_epi8(offset);
+    const __m256i cap = _mm256_set1_epi8(max_quality);
+    const __m256i backwards = _mm256_setr_epi8(
+        15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+        15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    size_t done = 0;
+    for ( ; done + vector_width <= len; done += vector_width) {
+        __m256i v = quality_chars(qual + done, off, cap);
+        char *out = dest + done;
+        if (reverse) {
+            v = _mm256_shuffle_epi8(v, backwards);
+            v = _mm256_permute2x128_si256(v, v, 1);
+            out = dest + len - done - vector_width;
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), v);
+    }
+    return done;
+}
+
+#elif defined(__SSE2__)
+
+const size_t vector_width = 16;
+
+//SSE2 has no byte shuffle, so reverse the 32-bit words, then the 16-bit
+//halves of each, then the bytes of each half
+inline __m128i reverse_bytes(__m128i v) {
+    v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+template<bool reverse>
+size_t decode_qualities_simd(const uint8_t *qual, size_t len, char *dest, int offset) {
+    const __m128i off = _mm_set1_epi8(offset);
+    const __m128i cap = _mm_set1_epi8(max_quality);
+    size_t done = 0;
+    for ( ; done + vector_width <= len; done += vector_width) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(qual + done));
+        v = _mm_min_epu8(_mm_adds_epu8(v, off), cap);
+        char *out = dest + done;
+        if (reverse) {
+            v = reverse_bytes(v);
+            out = dest + len - done - vector_width;
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out), v);
+    }
+    return done;
+}
+
+#else
+
+template<bool reverse>
+size_t decode_qualities_simd(const uint8_t *, size_t, char *, int) {
+    return 0;
+}
+
+#endif
+
+//The strand is a template parameter so that each read only branches on it
+//once, and the loops have nothing in them but the copying
+
+template<bool reverse>
+void decode_sequence_as(const uint8_t *seq, size_t len, char *dest) {
+    size_t whole = len / 2;
+    if (!reverse) {
+        for (size_t i = 0; i < whole; i++, dest += 2)
+            memcpy(dest, base_pairs[seq[i]], 2);
+        if (len & 1)
+            *dest = base_pairs[seq[whole]][0];
+        return;
+    }
+    //With an odd length the last base is alone in the high nibble
+    if (len & 1)
+        *dest++ = complement_pairs[seq[whole]][1];
+    for (size_t i = whole; i > 0; i--, dest += 2)
+        memcpy(dest, complement_pairs[seq[i-1]], 2);
+}
+
+//The vector loop does as much as it can, and the scalar one mops up
+template<bool reverse>
+void decode_qualities_as(const uint8_t *qual, size_t len, char *dest, int offset) {
+    size_t i = decode_qualities_simd<reverse>(qual, len, dest, offset);
+    if (reverse) {
+        for ( ; i < len; i++)
+            dest[len - 1 - i] = quality_char(qual[i], offset);
+    } else {
+        for ( ; i < len; i++)
+            dest[i] = quality_char(qual[i], offset);
+    }
+}
+
+//Sequence, + and qual, with offset added to each of those
+template<bool reverse>
+char *format_body(const bam1_t *b, const uint8_t *qual, char *dest, int offset) {
+    size_t len = b->core.l_qseq;
+    decode_sequence_as<reverse>(bam1_seq(b), len, dest);
+    dest += len;
+    memcpy(dest, "\n+\n", 3);
+    dest += 3;
+    decode_qualities_as<reverse>(qual, len, dest, offset);
+    dest += len;
+    *dest++ = '\n';
+    return dest;
+}
+
+//Writes text at dest + used, unless dest is NULL, in which case we're
+//only measuring
+inline void put(char *dest, size_t &used, const char *text, size_t length) {
+    if (dest)
+        memcpy(dest + used, text, length);
+    used += length;
+}
+
+//Bytes in a number of type t, or 0 if t isn't a number type
+inline size_t number_size(char t) {
+    switch (t) {
+        case 'c' : case 'C' : return 1;
+        case 's' : case 'S' : return 2;
+        case 'i' : case 'I' : case 'f' : return 4;
+    }
+    return 0;
+}
+
+//Bytes in the value of a tag of the given type, up to end, or 0 if it's
+//malformed or runs past end
+size_t tag_value_size(const uint8_t *type, const uint8_t *end) {
+    const uint8_t *value = type + 1;
+    size_t size = 0;
+    switch (*type) {
+        case 'A' :
+            size = 1;
+            break;
+        case 'Z' : case 'H' : {
+            const void *nul = memchr(value, 0, end - value);
+            return nul ? static_cast<const uint8_t *>(nul) - value + 1 : 0;
+        }
+        case 'B' : {
+            if (end - value < 5 || number_size(value[0]) == 0)
+                return 0;
+            uint32_t count;
+            memcpy(&count, value + 1, 4);
+            size = 5 + (uint64_t)count * number_size(value[0]);
+            break;
+        }
+        default :
+            size = number_size(*type);
+    }
+    return size > 0 && size <= (size_t)(end - value) ? size : 0;
+}
+
+size_t number_text(char t, const uint8_t *p, char *text) {
+    switch (t) {
+        case 'c' : { int8_t v; memcpy(&v, p, 1); return sprintf(text, "%d", v); }
+        case 'C' : { uint8_t v; memcpy(&v, p, 1); return sprintf(text, "%u", v); }
+        case 's' : { int16_t v; memcpy(&v, p, 2); return sprintf(text, "%d", v); }
+        case 'S' : { uint16_t v; memcpy(&v, p, 2); return sprintf(text, "%u", v); }
+        case 'i' : { int32_t v; memcpy(&v, p, 4); return sprintf(text, "%d", v); }
+        case 'I' : { uint32_t v; memcpy(&v, p, 4); return sprintf(text, "%u", v); }
+        case 'f' : { float v; memcpy(&v, p, 4); return sprintf(text, "%g", v); }
+    }
+    return 0;
+}
+
+//The tag whose type is at type, SAM style: BC:Z:ACGT, NM:i:0, XB:B:c,1,2
+size_t tag_text(const uint8_t *type, char *dest) {
+    size_t used = 0;
+    char text[32];
+    const uint8_t *value = type + 1;
+    put(dest, used, reinterpret_cast<const char *>(type) - 2, 2);
+    switch (*type) {
+        case 'A' : case 'Z' : case 'H' :
+            text[0] = ':';
+            text[1] = *type;
+            text[2] = ':';
+            put(dest, used, text, 3);
+            put(dest, used, reinterpret_cast<const char *>(value),
+                *type == 'A' ? 1 : strlen(reinterpret_cast<const char *>(value)));
+            break;
+        case 'B' : {
+            char sub = value[0];
+            uint32_t count;
+            memcpy(&count, value + 1, 4);
+            put(dest, used, ":B:", 3);
+            put(dest, used, &sub, 1);
+            for (uint32_t i = 0; i < count; i++) {
+                put(dest, used, ",", 1);
+                put(dest, used, text, number_text(sub, value + 5 + i * number_size(sub), text));
+            }
+            break;
+        }
+        default :
+            put(dest, used, *type == 'f' ? ":f:" : ":i:", 3);
+            put(dest, used, text, number_text(*type, value, text));
+    }
+    return used;
+}
+
+//The value of a Z tag, or NULL for anything else
+inline const char *z_value(const uint8_t *type) {
+    return (type && *type == 'Z') ? reinterpret_cast<const char *>(type + 1) : NULL;
+}
+
+//@name[suffix][comment]\n, or just its length with a NULL dest.  Index
+//reads don't get the /1 or /2, or the tags.
+size_t name_line(const bam1_t *b, size_t name_length, const FastqFormat &format,
+                 const RecordTags &found, bool index, char *dest) {
+    //The usual case, without anything to look up
+    if (format.suffix != SUFFIX_CASAVA && format.tags.empty()) {
+        bool mate = format.suffix == SUFFIX_MATE && (b->core.flag & BAM_FPAIRED) && !index;
+        size_t used = name_length + (mate ? 4 : 2);
+        if (dest) {
+            dest[0] = '@';
+            memcpy(dest + 1, bam1_qname(b), name_length);
+            if (mate) {
+                dest[used - 3] = '/';
+                dest[used - 2] = (b->core.flag & BAM_FREAD1) ? '1' : '2';
+            }
+            dest[used - 1] = '\n';
+        }
+        return used;
+    }
+    size_t used = 0;
+    put(dest, used, "@", 1);
+    put(dest, used, bam1_qname(b), name_length);
+    //Index reads are numbered like read 1, as bcl2fastq does
+    bool read2 = (b->core.flag & BAM_FPAIRED) && !(b->core.flag & BAM_FREAD1) && !index;
+    if (format.suffix == SUFFIX_CASAVA) {
+        char comment[8];
+        memcpy(comment, " 1:N:0:", 7);
+        if (read2)
+            comment[1] = '2';
+        if (b->core.flag & BAM_FQCFAIL)
+            comment[3] = 'Y';
+        put(dest, used, comment, 7);
+        if (const char *code = z_value(found.bc))
+            put(dest, used, code, strlen(code));
+    } else if (format.suffix == SUFFIX_MATE && (b->core.flag & BAM_FPAIRED) && !index) {
+        put(dest, used, read2 ? "/2" : "/1", 2);
+    }
+    if (!index) {
+        for (size_t i = 0; i < format.tags.size(); i++) {
+            if (found.tags[i]) {
+                put(dest, used, "\t", 1);
+                used += tag_text(found.tags[i], dest ? dest + used : NULL);
+            }
+        }
+    }
+    put(dest, used, "\n", 1);
+    return used;
+}
+
+//OQ, if it's wanted and it's the right length
+inline const char *original_qualities(const bam1_t *b, const FastqFormat &format,
+                                      const RecordTags &found) {
+    const char *oq = format.original_qualities ? z_value(found.oq) : NULL;
+    return (oq && strlen(oq) == (size_t)b->core.l_qseq) ? oq : NULL;
+}
+
+}
+
+void init_decode_tables() {
+    static const char bases[] = "=ACMGRSVTWYHKDBN";
+    static const char complements[] = "=TGKCYSBAWRDMHVN";
+    for (int x = 0; x < 256; x++) {
+        base_pairs[x][0] = bases[x >> 4];
+        base_pairs[x][1] = bases[x & 0xf];
+        complement_pairs[x][0] = complements[x & 0xf];
+        complement_pairs[x][1] = complements[x >> 4];
+    }
+}
+
+void decode_sequence(const bam1_t *b, char *dest) {
+    if (b->core.flag & BAM_FREVERSE)
+        decode_sequence_as<true>(bam1_seq(b), b->core.l_qseq, dest);
+    else
+        decode_sequence_as<false>(bam1_seq(b), b->core.l_qseq, dest);
+}
+
+void decode_qualities(const bam1_t *b, char *dest, int offset) {
+    if (b->core.flag & BAM_FREVERSE)
+        decode_qualities_as<true>(bam1_qual(b), b->core.l_qseq, dest, offset);
+    else
+        decode_qualities_as<false>(bam1_qual(b), b->core.l_qseq, dest, offset);
+}
+
+void find_tags(const bam1_t *b, const FastqFormat &format, RecordTags &found) {
+    memset(&found, 0, sizeof(found));
+    if (!format.needs_tags())
+        return;
+    const uint8_t *p = bam1_aux(b);
+    const uint8_t *end = b->data + b->data_len;
+    size_t wanted = format.tags.size();
+    while (end - p >= 3) {
+        const uint8_t *type = p + 2;
+        size_t size = tag_value_size(type, end);
+        if (size == 0)
+            break;
+        for (size_t i = 0; i < wanted; i++) {
+            if (p[0] == format.tags[i][0] && p[1] == format.tags[i][1] && !found.tags[i])
+                found.tags[i] = type;
+        }
+        if (p[0] == 'O' && p[1] == 'Q')
+            found.oq = type;
+        else if (p[0] == 'B' && p[1] == 'C')
+            found.bc = type;
+        else if (p[0] == 'Q' && p[1] == 'T')
+            found.qt = type;
+        p = type + 1 + size;
+    }
+}
+
+size_t fastq_length(const bam1_t *b, size_t name_length, const FastqFormat &format,
+                    const RecordTags &found) {
+    return name_line(b, name_length, format, found, false, NULL) + 2 * b->core.l_qseq + 4;
+}
+
+char *format_fastq(const bam1_t *b, size_t name_length, const FastqFormat &format,
+                   const RecordTags &found, char *dest) {
+    dest += name_line(b, name_length, format, found, false, dest);
+    const uint8_t *qual = bam1_qual(b);
+    int offset = format.offset;
+    //OQ is already Phred+33
+    if (const char *oq = original_qualities(b, format, found)) {
+        qual = reinterpret_cast<const uint8_t *>(oq);
+        offset -= 33;
+    }
+    if (b->core.flag & BAM_FREVERSE)
+        return format_body<true>(b, qual, dest, offset);
+    return format_body<false>(b, qual, dest, offset);
+}
+
+size_t index_length(const bam1_t *b, size_t name_length, const FastqFormat &format,
+                    const RecordTags &found) {
+    const char *code = z_value(found.bc);
+    size_t length = code ? strlen(code) : 0;
+    return name_line(b, name_length, format, found, true, NULL) + 2 * length + 4;
+}
+
+char *format_index(const bam1_t *b, size_t name_length, const FastqFormat &format,
+                   const RecordTags &found, char *dest) {
+    dest += name_line(b, name_length, format, found, true, dest);
+    const char *code = z_value(found.bc);
+    size_t length = code ? strlen(code) : 0;
+    if (code)
+        memcpy(dest, code, length);
+    dest += length;
+    memcpy(dest, "\n+\n", 3);
+    dest += 3;
+    const char *qt = z_value(found.qt);
+    if (qt && strlen(qt) == length)
+        decode_qualities_as<false>(reinterpret_cast<const uint8_t *>(qt), length, dest,
+                                   format.offset - 33);
+    else
+        memset(dest, format.offset, length);
+    dest += length;
+    *dest++ = '\n';
+    return dest;
+}
@@ -0,0 +1,104 @@
+/*
+Copyright 2010, HudsonAlpha Institute for Biotechnology
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+decode.h
+
+Turns packed BAM sequences and qualities into FASTQ text
+*/
+
+#ifndef BAM2FASTQ_DECODE_H
+#define BAM2FASTQ_DECODE_H
+
+#include "sam.h"
+#include <string>
+#include <vector>
+
+//Must be called once before decode_sequence
+void init_decode_tables();
+
+//Both of these write exactly l_qseq characters to dest, in the read's
+//original orientation (so BAM_FREVERSE reads are reverse complemented)
+
+void decode_sequence(const bam1_t *b, char *dest);
+
+//Adds offset (33 for Sanger FASTQ, 64 for old Illumina) to each quality,
+//capped at '~'
+void decode_qualities(const bam1_t *b, char *dest, int offset);
+
+//What follows the name of a read in its record
+enum NameSuffix {
+    //A /1 or /2 for the reads of a pair
+    SUFFIX_MATE,
+    SUFFIX_NONE,
+    //A Casava 1.8 style comment: " 1:N:0:" (read 2 or Y for failing QC
+    //as the case may be), then the barcode from the BC tag, if any
+    SUFFIX_CASAVA
+};
+
+//How records are written
+struct FastqFormat {
+    //The most tags a comment can have copied into it
+    static const size_t max_tags = 16;
+
+    FastqFormat() : offset(33), suffix(SUFFIX_MATE), original_qualities(false),
+                    index_reads(false) {}
+
+    //Added to each quality: 33 for Sanger FASTQ, 64 for old Illumina
+    int offset;
+    NameSuffix suffix;
+    //Copied into the comment after a tab each, in SAM form (BC:Z:ACGT)
+    std::vector<std::string> tags;
+    //OQ instead of the qualities, for the reads that have it
+    bool original_qualities;
+    //format_index will be wanted, so find_tags looks for BC and QT
+    bool index_reads;
+
+    //Whether records have to have their tags looked at at all
+    bool needs_tags() const {
+        return !tags.empty() || original_qualities || index_reads || suffix == SUFFIX_CASAVA;
+    }
+};
+
+//Where the tags a FastqFormat wants are in one record, or NULL for the
+//ones it hasn't got.  Each points at the tag's type.
+struct RecordTags {
+    const uint8_t *tags[FastqFormat::max_tags];
+    const uint8_t *oq;
+    const uint8_t *bc;
+    const uint8_t *qt;
+};
+
+//Fills in found with a single pass over b's tags
+void find_tags(const bam1_t *b, const FastqFormat &format, RecordTags &found);
+
+//The exact size of the FASTQ record format_fastq writes for b
+size_t fastq_length(const bam1_t *b, size_t name_length, const FastqFormat &format,
+                    const RecordTags &found);
+
+//Writes the whole four-line record for b, named by the first name_length
+//characters of its name, and returns the end of it.  dest needs
+//fastq_length() bytes.
+char *format_fastq(const bam1_t *b, size_t name_length, const FastqFormat &format,
+                   const RecordTags &found, char *dest);
+
+//The same for the index read: BC as the sequence and QT, or Phred 0
+//without it, as the qualities.  The name gets a Casava comment, if there
+//is one, but no /1 or /2.
+size_t index_length(const bam1_t *b, size_t name_length, const FastqFormat &format,
+                    const RecordTags &found);
+char *format_index(const bam1_t *b, size_t name_length, const FastqFormat &format,
+                   const RecordTags &found, char *dest);
+
+#endif
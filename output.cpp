@@ -0,0 +1,377 @@
+/*
+Copyright 2010, HudsonAlpha Institute for Biotechnology
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+output.cpp
+
+Buffered destinations for the FASTQ text
+*/
+
+#include "output.h"
+#include "stats.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <stdint.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+const size_t initial_buffer = 64 << 10;
+
+//The most text that goes in one BGZF block, as in samtools
+const size_t bgzf_block_input = 0xff00;
+const size_t bgzf_max_block = 0x10000;
+const size_t bgzf_header_size = 18;
+const size_t bgzf_footer_size = 8;
+
+//An empty block, which marks the end of a BGZF file
+const char bgzf_eof[28] = {
+    '\x1f', '\x8b', '\x08', '\x04', 0, 0, 0, 0, 0, '\xff', 6, 0, 'B', 'C', 2, 0,
+    27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+inline void put_le32(unsigned char *p, uint32_t x) {
+    p[0] = x;
+    p[1] = x >> 8;
+    p[2] = x >> 16;
+    p[3] = x >> 24;
+}
+
+}
+
+//A block of text on its way through the compressor
+struct CompressJob {
+    CompressJob() : length(0), sink(NULL), format(Compressor::GZIP), level(0),
+                    initialized(false), output_length(0) {
+        memset(&zs, 0, sizeof(zs));
+    }
+    ~CompressJob() {
+        if (initialized)
+            deflateEnd(&zs);
+    }
+
+    void run() {
+        StageTimer timer(Stats::COMPRESS);
+        output_length = 0;
+        if (format == Compressor::GZIP) {
+            deflate_gzip();
+            return;
+        }
+        for (size_t done = 0; done < length; done += bgzf_block_input)
+            deflate_bgzf(&input[done], min(length - done, bgzf_block_input));
+    }
+
+    //One gzip member for the lot
+    void deflate_gzip() {
+        if (!initialized)
+            deflateInit2(&zs, level, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY);
+        initialized = true;
+        deflateReset(&zs);
+        output.resize(max(output.size(), size_t(deflateBound(&zs, length))));
+        zs.next_in = reinterpret_cast<Bytef *>(&input[0]);
+        zs.avail_in = length;
+        zs.next_out = reinterpret_cast<Bytef *>(&output[0]);
+        zs.avail_out = output.size();
+        deflate(&zs, Z_FINISH);
+        output_length = zs.total_out;
+    }
+
+    //Raw deflate wrapped in a BGZF header and footer
+    void deflate_bgzf(char *text, size_t text_length) {
+        if (!initialized)
+            deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+        initialized = true;
+        output.resize(max(output.size(), output_length + bgzf_max_block));
+        unsigned char *block = reinterpret_cast<unsigned char *>(&output[output_length]);
+        size_t room = bgzf_max_block - bgzf_header_size - bgzf_footer_size;
+
+        deflateReset(&zs);
+        zs.next_in = reinterpret_cast<Bytef *>(text);
+        zs.avail_in = text_length;
+        zs.next_out = block + bgzf_header_size;
+        zs.avail_out = room;
+        int ret = deflate(&zs, Z_FINISH);
+        size_t compressed = zs.total_out;
+        if (ret != Z_STREAM_END) {
+            //It didn't fit, which only happens to text that doesn't
+            //compress at all.  Stored blocks always fit.
+            deflateReset(&zs);
+            deflateParams(&zs, 0, Z_DEFAULT_STRATEGY);
+            zs.next_in = reinterpret_cast<Bytef *>(text);
+            zs.avail_in = text_length;
+            zs.next_out = block + bgzf_header_size;
+            zs.avail_out = room;
+            deflate(&zs, Z_FINISH);
+            compressed = zs.total_out;
+            deflateReset(&zs);
+            deflateParams(&zs, level, Z_DEFAULT_STRATEGY);
+        }
+        size_t size = bgzf_header_size + compressed + bgzf_footer_size;
+
+        memcpy(block, bgzf_eof, 16);
+        block[16] = (size - 1) & 0xff;
+        block[17] = (size - 1) >> 8;
+        unsigned char *footer = block + size - bgzf_footer_size;
+        put_le32(footer, crc32(crc32(0, NULL, 0), reinterpret_cast<Bytef *>(text), text_length));
+        put_le32(footer + 4, text_length);
+        output_length += size;
+    }
+
+    vector<char> input;
+    size_t length;
+    OutputBuffer *sink;
+    Compressor::Format format;
+    int level;
+
+    z_stream zs;
+    bool initialized;
+    vector<char> output;
+    size_t output_length;
+};
+
+//Writes the compressed blocks out in order
+struct CompressWriter {
+    CompressWriter(OrderedPool<CompressJob> &pool, Compressor &compressor)
+        : pool(pool), compressor(compressor) {}
+
+    void run() {
+        CompressJob *job;
+        while ((job = pool.next()) != NULL) {
+            if (job->output_length > 0)
+                job->sink->write(&job->output[0], job->output_length);
+            pool.release(job);
+            compressor.written();
+        }
+    }
+
+    OrderedPool<CompressJob> &pool;
+    Compressor &compressor;
+};
+
+const size_t Compressor::block_size;
+
+Compressor::Compressor(Format format, int level, int threads)
+    : m_format(format), m_level(level), m_submitted(0), m_written(0) {
+    m_pool = new OrderedPool<CompressJob>(threads, 2 * threads + 2);
+    m_writer = new CompressWriter(*m_pool, *this);
+    m_writer_thread = new Thread<CompressWriter>(*m_writer);
+}
+
+Compressor::~Compressor() {
+    m_pool->finish();
+    m_writer_thread->join();
+    delete m_writer_thread;
+    delete m_writer;
+    delete m_pool;
+}
+
+void Compressor::compress(OutputBuffer *sink, vector<char> &data, size_t length) {
+    CompressJob *job = m_pool->acquire();
+    size_t capacity = data.size();
+    job->input.swap(data);
+    if (data.size() < capacity)
+        data.resize(capacity);
+    job->length = length;
+    job->sink = sink;
+    job->format = m_format;
+    job->level = m_level;
+    m_mutex.lock();
+    m_submitted++;
+    m_mutex.unlock();
+    m_pool->submit(job);
+}
+
+void Compressor::written() {
+    ScopedLock lock(m_mutex);
+    m_written++;
+    m_done.broadcast();
+}
+
+void Compressor::sync() {
+    ScopedLock lock(m_mutex);
+    while (m_written < m_submitted)
+        m_done.wait(m_mutex);
+}
+
+void Compressor::finish(OutputBuffer *sink) {
+    if (m_format == BGZF)
+        sink->write(bgzf_eof, sizeof(bgzf_eof));
+}
+
+BackgroundWriter::BackgroundWriter(OutputBuffer *sink, size_t depth)
+    : m_sink(sink), m_blocks(depth), m_empty(depth), m_full(depth), m_submitted(0),
+      m_written(0) {
+    for (size_t i = 0; i < m_blocks.size(); i++)
+        m_empty.push(&m_blocks[i]);
+    m_thread = new Thread<BackgroundWriter>(*this);
+}
+
+BackgroundWriter::~BackgroundWriter() {
+    m_full.close();
+    delete m_thread;
+}
+
+void BackgroundWriter::write(vector<char> &data, size_t length) {
+    Block *block = NULL;
+    m_empty.pop(block);
+    size_t capacity = data.size();
+    block->data.swap(data);
+    if (data.size() < capacity)
+        data.resize(capacity);
+    block->length = length;
+    m_submitted++;
+    m_full.push(block);
+}
+
+void BackgroundWriter::sync() {
+    ScopedLock lock(m_mutex);
+    while (m_written < m_submitted)
+        m_done.wait(m_mutex);
+}
+
+void BackgroundWriter::run() {
+    Block *block = NULL;
+    while (m_full.pop(block)) {
+        m_sink->write(&block->data[0], block->length);
+        m_empty.push(block);
+        ScopedLock lock(m_mutex);
+        m_written++;
+        m_done.broadcast();
+    }
+}
+
+OutputBuffer::OutputBuffer(int fd, bool owned, size_t capacity, Compressor *compressor,
+                           size_t queue)
+    : m_fd(fd), m_owned(owned), m_failed(false), m_compressor(compressor),
+      m_background(NULL), m_sink(NULL), m_capacity(capacity), m_used(0), m_writes(0),
+      m_bytes(0) {
+    if (compressor) {
+        m_sink = new OutputBuffer(fd, owned, capacity);
+        m_capacity = Compressor::block_size;
+    } else if (queue > 0) {
+        //Buffers that size go straight through the sink's write()
+        m_sink = new OutputBuffer(fd, owned, capacity);
+        m_background = new BackgroundWriter(m_sink, queue);
+    }
+    m_buffer.resize(min(m_capacity, initial_buffer));
+}
+
+OutputBuffer::~OutputBuffer() {
+    flush();
+    if (m_background) {
+        delete m_background;
+        delete m_sink;
+    } else if (m_sink) {
+        m_compressor->sync();
+        m_compressor->finish(m_sink);
+        delete m_sink;
+    } else if (m_owned && close(m_fd) != 0 && !m_failed) {
+        cerr << "ERROR: could not finish writing output: " << strerror(errno) << endl;
+    }
+}
+
+OutputBuffer *OutputBuffer::create(const string &path, size_t capacity, Compressor *compressor,
+                                   bool append, size_t queue) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0666);
+    if (fd < 0) {
+        cerr << "ERROR: could not create " << path << ": " << strerror(errno) << endl;
+        return NULL;
+    }
+    OutputBuffer *buffer = new OutputBuffer(fd, true, capacity, compressor, queue);
+    buffer->m_path = path;
+    return buffer;
+}
+
+void OutputBuffer::write_fully(const char *data, size_t length) {
+    StageTimer timer(Stats::WRITE);
+    if (Stats::current)
+        Stats::current->add_output_bytes(length);
+    while (length > 0 && !m_failed) {
+        ssize_t n = ::write(m_fd, data, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            cerr << "ERROR: could not write output: " << strerror(errno) << endl;
+            m_failed = true;
+            break;
+        }
+        data += n;
+        length -= n;
+    }
+}
+
+void OutputBuffer::flush() {
+    if (m_used == 0)
+        return;
+    if (m_background)
+        m_background->write(m_buffer, m_used);
+    else if (m_sink)
+        m_compressor->compress(m_sink, m_buffer, m_used);
+    else
+        write_fully(&m_buffer[0], m_used);
+    m_used = 0;
+}
+
+bool OutputBuffer::sync() {
+    flush();
+    if (m_background)
+        m_background->sync();
+    else if (m_sink)
+        m_compressor->sync();
+    //With nothing in flight, the sink is ours to flush
+    if (m_sink)
+        m_sink->flush();
+    if (!failed() && fsync(m_fd) != 0 && errno != EINVAL) {
+        cerr << "ERROR: could not sync " << (m_path.empty() ? "the output" : m_path) << ": "
+             << strerror(errno) << endl;
+        (m_sink ? m_sink->m_failed : m_failed) = true;
+    }
+    return !failed();
+}
+
+//Buffers start small and double up to their capacity, so that files
+//which only get a few reads don't cost a whole buffer each.  Only a record
+//bigger than the capacity makes one grow beyond it.
+void OutputBuffer::make_room(size_t length) {
+    if (m_used + length > m_capacity)
+        flush();
+    size_t needed = m_used + length;
+    if (needed > m_buffer.size())
+        m_buffer.resize(max(needed, min(m_capacity, 2 * m_buffer.size())));
+}
+
+void OutputBuffer::write(const char *data, size_t length) {
+    m_writes++;
+    m_bytes += length;
+    if (length >= m_capacity && !m_sink) {
+        flush();
+        write_fully(data, length);
+        return;
+    }
+    while (length > 0) {
+        if (m_used == m_buffer.size())
+            make_room(1);
+        size_t n = min(length, m_buffer.size() - m_used);
+        memcpy(&m_buffer[m_used], data, n);
+        m_used += n;
+        data += n;
+        length -= n;
+    }
+}
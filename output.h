@@ -0,0 +1,185 @@
+/*
+Copyright 2010, HudsonAlpha Institute for Biotechnology
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+output.h
+
+Buffered destinations for the FASTQ text
+*/
+
+#ifndef BAM2FASTQ_OUTPUT_H
+#define BAM2FASTQ_OUTPUT_H
+
+#include "threads.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class OutputBuffer;
+class BackgroundWriter;
+struct CompressJob;
+struct CompressWriter;
+
+//Compresses output on a pool of threads, in independent gzip members so
+//that each block can be done on its own.  BGZF is the same thing with
+//blocks of at most 64K and their sizes in the headers, which makes the
+//files indexable; plain gzip uses bigger members and compresses a little
+//better.  Either way the result reads with zcat, and the blocks go back
+//to each file in the order they were handed over.
+class Compressor {
+public:
+    enum Format { GZIP, BGZF };
+
+    Compressor(Format format, int level, int threads);
+    //Waits for everything handed over so far to be written
+    ~Compressor();
+
+    //How much text to hand over at a time
+    static const size_t block_size = 1 << 20;
+
+    //Compresses the first length bytes of data and writes the result to
+    //sink.  data is swapped for another buffer rather than copied.
+    void compress(OutputBuffer *sink, std::vector<char> &data, size_t length);
+    //Waits until everything handed over has been written out
+    void sync();
+    //Anything that has to come after the last block (the BGZF EOF marker)
+    void finish(OutputBuffer *sink);
+
+private:
+    Compressor(const Compressor &);
+    Compressor &operator=(const Compressor &);
+
+    friend struct CompressWriter;
+    void written();
+
+    Format m_format;
+    int m_level;
+    OrderedPool<CompressJob> *m_pool;
+    CompressWriter *m_writer;
+    Thread<CompressWriter> *m_writer_thread;
+    size_t m_submitted;
+    size_t m_written;
+    Mutex m_mutex;
+    Condition m_done;
+};
+
+//Records are formatted straight into a big buffer, which goes to the file
+//descriptor one write() at a time as it fills up.  Not thread-safe; only
+//the writer touches it.
+class OutputBuffer {
+public:
+    //Closes fd when done if owned is true.  With a compressor, the text
+    //is compressed before it goes into a buffer of that capacity.  Without
+    //one, queue > 0 has full buffers written on a thread of their own,
+    //with up to queue of them waiting.
+    OutputBuffer(int fd, bool owned, size_t capacity = 1 << 20,
+                 Compressor *compressor = NULL, size_t queue = 0);
+    //Flushes whatever is left
+    ~OutputBuffer();
+
+    //Creates (or truncates) path, or appends to it.  Returns NULL, after
+    //printing a message, if it can't.
+    static OutputBuffer *create(const std::string &path, size_t capacity,
+                                Compressor *compressor = NULL, bool append = false,
+                                size_t queue = 0);
+
+    //Room for at least length more bytes.  Follow with commit() to say
+    //how many of them were used.
+    char *reserve(size_t length) {
+        if (m_used + length > m_buffer.size())
+            make_room(length);
+        return &m_buffer[m_used];
+    }
+    void commit(size_t length) {
+        m_used += length;
+        m_writes++;
+        m_bytes += length;
+    }
+
+    void write(const char *data, size_t length);
+    void flush();
+    //Waits until everything written so far (compressed, if need be) has
+    //gone to the file, and then to the disk.  False if anything failed.
+    bool sync();
+
+    //True once a write has failed (which has already been reported)
+    bool failed() const { return m_sink ? m_sink->failed() : m_failed; }
+    //What create() was given, or "" for a file descriptor
+    const std::string &path() const { return m_path; }
+    //How many write()s and commit()s there have been (one per record, the
+    //way the FASTQ is written), and the bytes they added before any
+    //compression
+    uint64_t writes() const { return m_writes; }
+    uint64_t bytes() const { return m_bytes; }
+
+private:
+    OutputBuffer(const OutputBuffer &);
+    OutputBuffer &operator=(const OutputBuffer &);
+
+    void make_room(size_t length);
+    void write_fully(const char *data, size_t length);
+
+    int m_fd;
+    std::string m_path;
+    bool m_owned;
+    bool m_failed;
+    Compressor *m_compressor;
+    BackgroundWriter *m_background;
+    //Where the compressed text goes, when there's a compressor, or the
+    //background writer's buffers
+    OutputBuffer *m_sink;
+    size_t m_capacity;
+    std::vector<char> m_buffer;
+    size_t m_used;
+    uint64_t m_writes;
+    uint64_t m_bytes;
+};
+
+//Writes buffers to sink on a thread of its own, so that whoever fills
+//them only has to wait once depth of them are queued up - when whatever
+//is reading a pipe falls behind, say
+class BackgroundWriter {
+public:
+    BackgroundWriter(OutputBuffer *sink, size_t depth);
+    //Writes everything queued first
+    ~BackgroundWriter();
+
+    //data is swapped for an empty buffer rather than copied
+    void write(std::vector<char> &data, size_t length);
+    //Waits until everything handed over has been written to the sink
+    void sync();
+
+    void run();
+
+private:
+    BackgroundWriter(const BackgroundWriter &);
+    BackgroundWriter &operator=(const BackgroundWriter &);
+
+    struct Block {
+        std::vector<char> data;
+        size_t length;
+    };
+
+    OutputBuffer *m_sink;
+    std::vector<Block> m_blocks;
+    BlockingQueue<Block *> m_empty;
+    BlockingQueue<Block *> m_full;
+    Thread<BackgroundWriter> *m_thread;
+    size_t m_submitted;
+    size_t m_written;
+    Mutex m_mutex;
+    Condition m_done;
+};
+
+#endif
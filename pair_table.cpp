@@ -0,0 +1,434 @@
+/*
+Copyright 2010, HudsonAlpha Institute for Biotechnology
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+pair_table.cpp
+
+Holds reads that are waiting for their mates
+*/
+
+#include "pair_table.h"
+#include <unistd.h>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+const size_t initial_slots = 1024;
+
+//Records bigger than this (long reads, mostly) aren't worth keeping free
+//lists for, there won't be another one the same size
+const size_t max_reused_size = 4096;
+
+//What goes in the arena, followed by data_len bytes of name, packed
+//sequence, qualities and maybe tags
+struct RecordHeader {
+    uint64_t hash;
+    uint32_t size;
+    uint32_t key_length;
+    int32_t data_len;
+    uint32_t live;
+    bam1_core_t core;
+};
+
+inline RecordHeader *header_of(unsigned char *record) {
+    return reinterpret_cast<RecordHeader *>(record);
+}
+
+inline const char *name_of(const unsigned char *record) {
+    return reinterpret_cast<const char *>(record + sizeof(RecordHeader));
+}
+
+//A free record keeps its header, so the arena can still be walked, and
+//links to the next free one of its size where its name was
+inline unsigned char *&next_free(unsigned char *record) {
+    return *reinterpret_cast<unsigned char **>(record + sizeof(RecordHeader));
+}
+
+//Whatever follows the qualities
+inline int aux_length(const bam1_t *b) {
+    const bam1_core_t &c = b->core;
+    return b->data_len - c.l_qname - 4 * c.n_cigar - (c.l_qseq + 1) / 2 - c.l_qseq;
+}
+
+void make_view(unsigned char *record, bam1_t *b) {
+    const RecordHeader *h = header_of(record);
+    b->core = h->core;
+    b->data = record + sizeof(RecordHeader);
+    b->data_len = h->data_len;
+    b->m_data = 0;
+    b->l_aux = aux_length(b);
+}
+
+//Sorts the leftovers the same way the old map<string, string> did
+struct KeyLess {
+    bool operator()(unsigned char *a, unsigned char *b) const {
+        size_t la = header_of(a)->key_length;
+        size_t lb = header_of(b)->key_length;
+        int c = memcmp(name_of(a), name_of(b), min(la, lb));
+        return c < 0 || (c == 0 && la < lb);
+    }
+};
+
+}
+
+PairTable::PairTable(size_t chunk_bytes, bool keep_aux)
+    : m_slots(initial_slots), m_count(0), m_peak_count(0), m_peak_memory(0), m_chunk_bytes(chunk_bytes), m_keep_aux(keep_aux),
+      m_live_bytes(0), m_arena_bytes(0), m_free(max_reused_size / 8 + 1),
+      m_taken(NULL) {
+    for (size_t i = 0; i < m_slots.size(); i++)
+        m_slots[i].record = NULL;
+}
+
+PairTable::~PairTable() {
+    for (size_t i = 0; i < m_chunks.size(); i++)
+        free(m_chunks[i].data);
+}
+
+//FNV-1a
+uint64_t PairTable::hash(const char *key, size_t length) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        h ^= static_cast<unsigned char>(key[i]);
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+size_t PairTable::find(const char *key, size_t length, uint64_t hash) const {
+    size_t mask = m_slots.size() - 1;
+    for (size_t i = hash & mask; m_slots[i].record; i = (i + 1) & mask) {
+        const unsigned char *record = m_slots[i].record;
+        if (m_slots[i].hash == hash &&
+                header_of(m_slots[i].record)->key_length == length &&
+                memcmp(name_of(record), key, length) == 0)
+            return i;
+    }
+    return m_slots.size();
+}
+
+size_t PairTable::slot_of(const unsigned char *record) const {
+    size_t mask = m_slots.size() - 1;
+    size_t i = header_of(const_cast<unsigned char *>(record))->hash & mask;
+    while (m_slots[i].record != record)
+        i = (i + 1) & mask;
+    return i;
+}
+
+bool PairTable::take(const char *key, size_t length, uint64_t hash, bam1_t *mate) {
+    size_t slot = find(key, length, hash);
+    if (slot == m_slots.size())
+        return false;
+    release_taken();
+    RecordHeader *h = header_of(m_slots[slot].record);
+    make_view(m_slots[slot].record, mate);
+    h->live = 0;
+    m_live_bytes -= h->size;
+    m_taken = m_slots[slot].record;
+    erase(slot);
+    return true;
+}
+
+//Now that the caller is done with the last read taken
+void PairTable::release_taken() {
+    if (m_taken == NULL)
+        return;
+    size_t size = header_of(m_taken)->size;
+    if (size <= max_reused_size) {
+        next_free(m_taken) = m_free[size / 8];
+        m_free[size / 8] = m_taken;
+    }
+    m_taken = NULL;
+}
+
+unsigned char *PairTable::reuse(size_t size) {
+    if (size > max_reused_size || m_free[size / 8] == NULL)
+        return NULL;
+    unsigned char *record = m_free[size / 8];
+    m_free[size / 8] = next_free(record);
+    return record;
+}
+
+//After chunks have been freed or moved
+void PairTable::rebuild_free_lists() {
+    fill(m_free.begin(), m_free.end(), static_cast<unsigned char *>(NULL));
+    m_taken = NULL;
+    for (size_t i = 0; i < m_chunks.size(); i++) {
+        for (size_t offset = 0; offset < m_chunks[i].used; ) {
+            unsigned char *record = m_chunks[i].data + offset;
+            size_t size = header_of(record)->size;
+            offset += size;
+            if (!header_of(record)->live && size <= max_reused_size) {
+                next_free(record) = m_free[size / 8];
+                m_free[size / 8] = record;
+            }
+        }
+    }
+}
+
+//Linear probing lets us delete without tombstones, by shifting back any
+//later entries that would otherwise become unreachable
+void PairTable::erase(size_t slot) {
+    size_t mask = m_slots.size() - 1;
+    size_t hole = slot;
+    for (size_t i = (hole + 1) & mask; m_slots[i].record; i = (i + 1) & mask) {
+        size_t home = m_slots[i].hash & mask;
+        bool reachable = (hole <= i) ? (hole < home && home <= i)
+                                     : (hole < home || home <= i);
+        if (!reachable) {
+            m_slots[hole] = m_slots[i];
+            hole = i;
+        }
+    }
+    m_slots[hole].record = NULL;
+    m_count--;
+}
+
+void PairTable::grow() {
+    vector<Slot> old(m_slots.size() * 2);
+    old.swap(m_slots);
+    for (size_t i = 0; i < m_slots.size(); i++)
+        m_slots[i].record = NULL;
+    size_t mask = m_slots.size() - 1;
+    for (size_t i = 0; i < old.size(); i++) {
+        if (!old[i].record)
+            continue;
+        size_t j = old[i].hash & mask;
+        while (m_slots[j].record)
+            j = (j + 1) & mask;
+        m_slots[j] = old[i];
+    }
+}
+
+void PairTable::insert(size_t length, uint64_t hash, const bam1_t *read) {
+    if (2 * (m_count + 1) > m_slots.size())
+        grow();
+    release_taken();
+
+    //Taken records leave holes in the arena; once they outweigh the reads
+    //we're still holding, squeeze them out
+    if (m_arena_bytes > 2 * m_chunk_bytes && m_arena_bytes > 2 * m_live_bytes)
+        compact();
+
+    const bam1_core_t &c = read->core;
+    size_t seq_bytes = (c.l_qseq + 1) / 2;
+    size_t aux_bytes = m_keep_aux ? read->l_aux : 0;
+    size_t data_len = c.l_qname + seq_bytes + c.l_qseq + aux_bytes;
+    size_t size = (sizeof(RecordHeader) + data_len + 7) & ~size_t(7);
+
+    unsigned char *record = reuse(size);
+    if (record == NULL)
+        record = allocate(size);
+    RecordHeader *h = header_of(record);
+    h->hash = hash;
+    h->live = 1;
+    h->size = size;
+    h->key_length = length;
+    h->data_len = data_len;
+    h->core = c;
+    h->core.n_cigar = 0;
+    unsigned char *data = record + sizeof(RecordHeader);
+    memcpy(data, bam1_qname(read), c.l_qname);
+    memcpy(data + c.l_qname, bam1_seq(read), seq_bytes);
+    memcpy(data + c.l_qname + seq_bytes, bam1_qual(read), c.l_qseq);
+    if (aux_bytes > 0)
+        memcpy(data + c.l_qname + seq_bytes + c.l_qseq, bam1_aux(read), aux_bytes);
+    m_live_bytes += size;
+
+    size_t mask = m_slots.size() - 1;
+    size_t i = hash & mask;
+    while (m_slots[i].record)
+        i = (i + 1) & mask;
+    m_slots[i].hash = hash;
+    m_slots[i].record = record;
+    m_count++;
+    //Only inserting makes the table any bigger
+    m_peak_count = max(m_peak_count, m_count);
+    m_peak_memory = max(m_peak_memory, memory());
+}
+
+unsigned char *PairTable::allocate(size_t size) {
+    if (m_chunks.empty() || m_chunks.back().used + size > m_chunks.back().capacity) {
+        Chunk chunk;
+        chunk.capacity = max(m_chunk_bytes, size);
+        chunk.data = static_cast<unsigned char *>(malloc(chunk.capacity));
+        chunk.used = 0;
+        m_chunks.push_back(chunk);
+        m_arena_bytes += chunk.capacity;
+    }
+    Chunk &chunk = m_chunks.back();
+    unsigned char *p = chunk.data + chunk.used;
+    chunk.used += size;
+    return p;
+}
+
+//Walks the old chunks in order, so the reads stay oldest first
+void PairTable::compact() {
+    vector<Chunk> old;
+    old.swap(m_chunks);
+    m_arena_bytes = 0;
+    for (size_t i = 0; i < old.size(); i++) {
+        for (size_t offset = 0; offset < old[i].used; ) {
+            unsigned char *record = old[i].data + offset;
+            size_t size = header_of(record)->size;
+            offset += size;
+            if (!header_of(record)->live)
+                continue;
+            unsigned char *moved = allocate(size);
+            memcpy(moved, record, size);
+            m_slots[slot_of(record)].record = moved;
+        }
+        free(old[i].data);
+    }
+    rebuild_free_lists();
+}
+
+void PairTable::spill_oldest(PairSpill &spill, size_t target) {
+    bam1_t read;
+    while (memory() > target && !m_chunks.empty()) {
+        Chunk &chunk = m_chunks.front();
+        for (size_t offset = 0; offset < chunk.used; ) {
+            unsigned char *record = chunk.data + offset;
+            RecordHeader *h = header_of(record);
+            offset += h->size;
+            if (!h->live)
+                continue;
+            make_view(record, &read);
+            spill.write(&read, h->key_length, h->hash);
+            m_live_bytes -= h->size;
+            erase(slot_of(record));
+        }
+        m_arena_bytes -= chunk.capacity;
+        free(chunk.data);
+        m_chunks.erase(m_chunks.begin());
+    }
+    rebuild_free_lists();
+}
+
+void PairTable::remaining(vector<bam1_t> &reads) const {
+    vector<unsigned char *> records;
+    records.reserve(m_count);
+    for (size_t i = 0; i < m_slots.size(); i++)
+        if (m_slots[i].record)
+            records.push_back(m_slots[i].record);
+    sort(records.begin(), records.end(), KeyLess());
+
+    reads.resize(records.size());
+    for (size_t i = 0; i < records.size(); i++)
+        make_view(records[i], &reads[i]);
+}
+
+size_t PairTable::memory() const {
+    return m_slots.size() * sizeof(Slot) + m_arena_bytes;
+}
+
+bool write_record(FILE *file, const bam1_t *read) {
+    return fwrite(&read->core, sizeof(read->core), 1, file) == 1 &&
+        fwrite(&read->data_len, sizeof(read->data_len), 1, file) == 1 &&
+        fwrite(read->data, 1, read->data_len, file) == (size_t)read->data_len;
+}
+
+bool read_record(FILE *file, bam1_t *read) {
+    int32_t data_len;
+    if (fread(&read->core, sizeof(read->core), 1, file) != 1 ||
+            fread(&data_len, sizeof(data_len), 1, file) != 1 || data_len < 0)
+        return false;
+    if (read->m_data < data_len) {
+        read->m_data = data_len;
+        kroundup32(read->m_data);
+        read->data = static_cast<uint8_t *>(realloc(read->data, read->m_data));
+    }
+    if (fread(read->data, 1, data_len, file) != (size_t)data_len)
+        return false;
+    read->data_len = data_len;
+    read->l_aux = aux_length(read);
+    return true;
+}
+
+//Temporary files go in $TMPDIR, and are unlinked as soon as they're made
+PairSpill::PairSpill(size_t partitions)
+    : m_files(partitions, static_cast<FILE *>(NULL)), m_reading(partitions, false),
+      m_spilled(0), m_failed(false) {}
+
+PairSpill::~PairSpill() {
+    for (size_t i = 0; i < m_files.size(); i++)
+        if (m_files[i])
+            fclose(m_files[i]);
+}
+
+FILE *PairSpill::create() {
+    const char *dir = getenv("TMPDIR");
+    string path(dir && *dir ? dir : "/tmp");
+    path += "/bam2fastq.XXXXXX";
+    vector<char> buf(path.begin(), path.end());
+    buf.push_back('\0');
+    int fd = mkstemp(&buf[0]);
+    if (fd < 0) {
+        cerr << "ERROR: could not create a temporary file in " << (dir && *dir ? dir : "/tmp") << endl;
+        return NULL;
+    }
+    unlink(&buf[0]);
+    FILE *file = fdopen(fd, "w+b");
+    if (file == NULL)
+        close(fd);
+    return file;
+}
+
+//Each entry is key length and hash, then the stripped-down record
+void PairSpill::write(const bam1_t *read, size_t key_length, uint64_t hash) {
+    if (m_failed)
+        return;
+    size_t p = (hash >> 40) % m_files.size();
+    if (m_files[p] == NULL && (m_files[p] = create()) == NULL) {
+        m_failed = true;
+        return;
+    }
+    uint32_t length = key_length;
+    FILE *file = m_files[p];
+    if (fwrite(&length, sizeof(length), 1, file) != 1 ||
+            fwrite(&hash, sizeof(hash), 1, file) != 1 || !write_record(file, read)) {
+        cerr << "ERROR: could not write to a temporary file" << endl;
+        m_failed = true;
+        return;
+    }
+    m_spilled++;
+}
+
+bool PairSpill::read(size_t p, bam1_t *read, size_t &key_length, uint64_t &hash) {
+    FILE *file = m_files[p];
+    if (file == NULL)
+        return false;
+    if (!m_reading[p]) {
+        fflush(file);
+        rewind(file);
+        m_reading[p] = true;
+    }
+    uint32_t length;
+    if (fread(&length, sizeof(length), 1, file) != 1 ||
+            fread(&hash, sizeof(hash), 1, file) != 1 || !read_record(file, read))
+        return false;
+    key_length = length;
+    return true;
+}
+
+void PairSpill::close(size_t p) {
+    if (m_files[p])
+        fclose(m_files[p]);
+    m_files[p] = NULL;
+}
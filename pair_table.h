@@ -0,0 +1,173 @@
+/*
+Copyright 2010, HudsonAlpha Institute for Biotechnology
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+pair_table.h
+
+Holds reads that are waiting for their mates
+*/
+
+#ifndef BAM2FASTQ_PAIR_TABLE_H
+#define BAM2FASTQ_PAIR_TABLE_H
+
+#include "sam.h"
+#include <stdint.h>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+class PairSpill;
+
+//Pair names are the read name, without the /1 or /2 that some pipelines
+//leave on the end (unless strict_names, for --strict).  That's always a
+//prefix of the name, of which length is the strlen.
+template<bool strict_names>
+size_t pair_key_length(const char *name, size_t length) {
+    if (strict_names || length < 3)
+        return length;
+    if (isdigit(name[length-1]) && !isdigit(name[length-2]))
+        length -= 2;
+    return length;
+}
+
+template<bool strict_names>
+size_t pair_key_length(const bam1_t *b) {
+    const char *name = bam1_qname(b);
+    return pair_key_length<strict_names>(name, strlen(name));
+}
+
+//An open-addressing hash table of reads keyed on their pair name.  The
+//reads themselves are kept as stripped-down records (core, name, sequence
+//and qualities, no cigar, and only the tags if asked) in a compacting
+//arena.  The space of a taken read goes on a free list for its size, for
+//the next read of the same size to reuse.  A read's key is always a prefix
+//of its name, so it isn't stored separately.
+//
+//Reads handed back by take() and remaining() are views into the arena:
+//don't bam_destroy1 them, and don't hold them across another take() or
+//insert().
+class PairTable {
+public:
+    //The arena grows chunk_bytes at a time.  With keep_aux, the reads
+    //handed back still have their tags.
+    explicit PairTable(size_t chunk_bytes = 4 << 20, bool keep_aux = false);
+    ~PairTable();
+
+    static uint64_t hash(const char *key, size_t length);
+
+    //If the mate of the read with this key is buffered, removes it and
+    //points mate at it.  Otherwise returns false.
+    bool take(const char *key, size_t length, uint64_t hash, bam1_t *mate);
+    //Buffers read, whose key is the first length bytes of its name
+    void insert(size_t length, uint64_t hash, const bam1_t *read);
+
+    //Every read still in the table, in key order
+    void remaining(std::vector<bam1_t> &reads) const;
+
+    //Moves the oldest reads into spill until memory() is down to target
+    //(or the table is empty)
+    void spill_oldest(PairSpill &spill, size_t target);
+
+    size_t size() const { return m_count; }
+    //Bytes held by the table and its arena
+    size_t memory() const;
+    //The most reads, and bytes, the table has held at once
+    size_t peak_size() const { return m_peak_count; }
+    size_t peak_memory() const { return m_peak_memory; }
+
+private:
+    struct Slot {
+        uint64_t hash;
+        unsigned char *record;
+    };
+
+    //Records are allocated oldest first, so apart from reused space the
+    //arena also keeps them in age order
+    struct Chunk {
+        unsigned char *data;
+        size_t capacity;
+        size_t used;
+    };
+
+    PairTable(const PairTable &);
+    PairTable &operator=(const PairTable &);
+
+    size_t find(const char *key, size_t length, uint64_t hash) const;
+    size_t slot_of(const unsigned char *record) const;
+    void erase(size_t slot);
+    void grow();
+    unsigned char *allocate(size_t size);
+    unsigned char *reuse(size_t size);
+    void release_taken();
+    void rebuild_free_lists();
+    void compact();
+
+    std::vector<Slot> m_slots;
+    size_t m_count;
+    size_t m_peak_count;
+    size_t m_peak_memory;
+
+    size_t m_chunk_bytes;
+    bool m_keep_aux;
+    std::vector<Chunk> m_chunks;
+    size_t m_live_bytes;
+    size_t m_arena_bytes;
+
+    //Indexed by record size / 8.  The last record taken isn't on them
+    //yet, because its view is still in use.
+    std::vector<unsigned char *> m_free;
+    unsigned char *m_taken;
+};
+
+//A record the way PairSpill stores them, for other files of our own.  On
+//the way back, read owns its data, as if it came from bam_read1.
+bool write_record(FILE *file, const bam1_t *read);
+bool read_record(FILE *file, bam1_t *read);
+
+//Partitioned temporary files for reads pushed out of a PairTable.  Mates
+//always hash to the same partition, so each partition can be matched up
+//on its own once the BAM has been read.
+class PairSpill {
+public:
+    explicit PairSpill(size_t partitions);
+    ~PairSpill();
+
+    size_t partitions() const { return m_files.size(); }
+    //Number of reads written so far
+    size_t spilled() const { return m_spilled; }
+    //True if a temporary file couldn't be created or written
+    bool failed() const { return m_failed; }
+
+    void write(const bam1_t *read, size_t key_length, uint64_t hash);
+
+    //Reads partition p back from the start.  read owns its data, as if it
+    //came from bam_read1.  Returns false at the end of the partition.
+    bool read(size_t p, bam1_t *read, size_t &key_length, uint64_t &hash);
+    //Done with partition p, so delete it
+    void close(size_t p);
+
+private:
+    PairSpill(const PairSpill &);
+    PairSpill &operator=(const PairSpill &);
+
+    FILE *create();
+
+    std::vector<FILE *> m_files;
+    std::vector<bool> m_reading;
+    size_t m_spilled;
+    bool m_failed;
+};
+
+#endif
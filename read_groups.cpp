@@ -0,0 +1,142 @@
+/*
+Copyright 2010, HudsonAlpha Institute for Biotechnology
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+read_groups.cpp
+
+Works out which lane and read group each read came from
+*/
+
+#include "read_groups.h"
+#include <cctype>
+#include <cstring>
+
+using namespace std;
+
+namespace {
+
+//Parses the digits in [p, end), which have to be all there is
+int parse_lane(const char *p, const char *end) {
+    if (p == end)
+        return 0;
+    int lane = 0;
+    for ( ; p < end; p++) {
+        if (!isdigit(*p))
+            return 0;
+        lane = 10 * lane + (*p - '0');
+    }
+    return lane;
+}
+
+//The first all-digit part of a PU after the flowcell, e.g. 3 in FC1.3
+int lane_from_unit(const string &unit) {
+    size_t start = unit.find('.');
+    while (start != string::npos) {
+        start++;
+        size_t stop = unit.find('.', start);
+        size_t end = stop == string::npos ? unit.size() : stop;
+        int lane = parse_lane(unit.data() + start, unit.data() + end);
+        if (lane > 0)
+            return lane;
+        start = stop;
+    }
+    return 0;
+}
+
+//The value of tag (e.g. "ID:") in the tab-separated fields [p, end)
+string field(const char *p, const char *end, const char *tag) {
+    size_t tag_length = strlen(tag);
+    while (p < end) {
+        const char *stop = static_cast<const char *>(memchr(p, '\t', end - p));
+        if (stop == NULL)
+            stop = end;
+        if (size_t(stop - p) >= tag_length && memcmp(p, tag, tag_length) == 0)
+            return string(p + tag_length, stop);
+        p = stop + 1;
+    }
+    return string();
+}
+
+}
+
+//Leading digits after the first colon, and only those, count as a lane
+int lane_from_name(const char *name) {
+    const char *start = strchr(name, ':');
+    if (start == NULL)
+        return 0;
+    start++;
+    const char *stop = strchr(start, ':');
+    if (stop == NULL || stop == start)
+        return 0;
+    int lane = 0;
+    for (const char *p = start; p < stop && isdigit(*p); p++)
+        lane = 10 * lane + (*p - '0');
+    return lane;
+}
+
+ReadGroups::ReadGroups(const bam_header_t *header) : m_last(-1) {
+    add_header(header);
+}
+
+void ReadGroups::add_header(const bam_header_t *header) {
+    if (header == NULL || header->text == NULL)
+        return;
+    const char *text = header->text;
+    const char *end = text + strlen(text);
+    for (const char *line = text; line < end; ) {
+        const char *stop = static_cast<const char *>(memchr(line, '\n', end - line));
+        if (stop == NULL)
+            stop = end;
+        if (stop - line > 4 && memcmp(line, "@RG\t", 4) == 0) {
+            string id = field(line + 4, stop, "ID:");
+            if (!id.empty() && m_index.find(id) == m_index.end())
+                add(id, lane_from_unit(field(line + 4, stop, "PU:")));
+        }
+        line = stop + 1;
+    }
+}
+
+int ReadGroups::add(const string &id, int lane) {
+    m_index[id] = m_ids.size();
+    m_ids.push_back(id);
+    m_lanes.push_back(lane);
+    return m_ids.size() - 1;
+}
+
+int ReadGroups::group(const bam1_t *b) {
+    const uint8_t *tag = bam_aux_get(b, "RG");
+    if (tag == NULL || *tag != 'Z')
+        return -1;
+    const char *id = reinterpret_cast<const char *>(tag + 1);
+    if (m_last >= 0 && m_ids[m_last] == id)
+        return m_last;
+    map<string, int>::const_iterator i = m_index.find(id);
+    m_last = i != m_index.end() ? i->second : add(id, 0);
+    return m_last;
+}
+
+int ReadGroups::group(const string &id) {
+    map<string, int>::const_iterator i = m_index.find(id);
+    return i != m_index.end() ? i->second : add(id, 0);
+}
+
+//The name is the cheaper place to look, so the tags only get searched
+//when it doesn't have a lane
+int ReadGroups::lane(const bam1_t *b) {
+    int lane = lane_from_name(bam1_qname(b));
+    if (lane > 0 || m_ids.empty())
+        return lane;
+    int g = group(b);
+    return g < 0 ? 0 : m_lanes[g];
+}
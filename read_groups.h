@@ -0,0 +1,64 @@
+/*
+Copyright 2010, HudsonAlpha Institute for Biotechnology
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+read_groups.h
+
+Works out which lane and read group each read came from
+*/
+
+#ifndef BAM2FASTQ_READ_GROUPS_H
+#define BAM2FASTQ_READ_GROUPS_H
+
+#include "sam.h"
+#include <map>
+#include <string>
+#include <vector>
+
+//The lane of an Illumina-style read name (machine:lane:tile:x:y), or 0
+int lane_from_name(const char *name);
+
+//The @RG lines of a BAM header, plus any read groups that only turn up
+//in RG tags.  Groups are numbered in the order they're found, so callers
+//can key on a small integer rather than the ID.  Not thread-safe.
+class ReadGroups {
+public:
+    explicit ReadGroups(const bam_header_t *header);
+
+    //Picks up the @RG lines of another input's header.  Groups we already
+    //know keep their numbers.
+    void add_header(const bam_header_t *header);
+
+    //The read's RG tag as a group number, or -1 if it hasn't got one
+    int group(const bam1_t *b);
+    //The same for an RG ID, numbering it if it's new
+    int group(const std::string &id);
+    const std::string &id(int group) const { return m_ids[group]; }
+
+    //The lane from the read name or, for names without one, from the
+    //lane at the end of its read group's PU (flowcell.lane).  0 if
+    //neither says.
+    int lane(const bam1_t *b);
+
+private:
+    int add(const std::string &id, int lane);
+
+    std::vector<std::string> m_ids;
+    std::vector<int> m_lanes;
+    std::map<std::string, int> m_index;
+    //Reads from the same group tend to come together
+    int m_last;
+};
+
+#endif
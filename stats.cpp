@@ -0,0 +1,179 @@
+/*
+Copyright 2010, HudsonAlpha Institute for Biotechnology
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+stats.cpp
+
+Timing and throughput figures for --stats and --progress
+*/
+
+#include "stats.h"
+#include <sys/resource.h>
+#include <time.h>
+#include <iostream>
+#include <iomanip>
+
+using namespace std;
+
+namespace {
+
+const char *stage_names[Stats::STAGES] = { "read", "format", "pair", "compress", "write" };
+
+double seconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double wall_clock() { return seconds(CLOCK_MONOTONIC); }
+
+double thread_cpu() { return seconds(CLOCK_THREAD_CPUTIME_ID); }
+
+double timeval_seconds(const struct timeval &tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+//The innermost StageTimer running on this thread
+__thread StageTimer *current_timer = NULL;
+
+}
+
+Stats *Stats::current = NULL;
+
+Stats::Stats()
+    : m_start(wall_clock()), m_bytes_in(0), m_bytes_out(0), m_orphans(0), m_peak_reads(0),
+      m_peak_bytes(0), m_seen(0), m_exported(0) {
+    for (int i = 0; i < STAGES; i++)
+        m_wall[i] = m_cpu[i] = 0;
+}
+
+void Stats::add_time(Stage stage, double wall, double cpu) {
+    ScopedLock lock(m_mutex);
+    m_wall[stage] += wall;
+    m_cpu[stage] += cpu;
+}
+
+void Stats::add_input_bytes(size_t bytes) {
+    ScopedLock lock(m_mutex);
+    m_bytes_in += bytes;
+}
+
+void Stats::add_output_bytes(size_t bytes) {
+    ScopedLock lock(m_mutex);
+    m_bytes_out += bytes;
+}
+
+void Stats::add_orphans(size_t reads) {
+    ScopedLock lock(m_mutex);
+    m_orphans += reads;
+}
+
+void Stats::pair_table_size(size_t reads, size_t bytes) {
+    ScopedLock lock(m_mutex);
+    m_peak_reads = max(m_peak_reads, reads);
+    m_peak_bytes = max(m_peak_bytes, bytes);
+}
+
+void Stats::set_records(size_t seen, size_t exported) {
+    ScopedLock lock(m_mutex);
+    m_seen = seen;
+    m_exported = exported;
+}
+
+//Stage times add up over every thread that did that stage, so with
+//--threads they can come to more than the total
+void Stats::report(ostream &out, bool json) {
+    ScopedLock lock(m_mutex);
+    double wall = wall_clock() - m_start;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double cpu = timeval_seconds(usage.ru_utime) + timeval_seconds(usage.ru_stime);
+    double rate = wall > 0 ? m_seen / wall : 0;
+
+    ios::fmtflags flags = out.flags();
+    streamsize precision = out.precision();
+    out << fixed << setprecision(3);
+    if (json) {
+        out << "{\"records_in\": " << m_seen
+            << ", \"records_exported\": " << m_exported
+            << ", \"records_per_second\": " << rate
+            << ", \"bytes_in\": " << m_bytes_in
+            << ", \"bytes_out\": " << m_bytes_out
+            << ", \"pair_table_peak_reads\": " << m_peak_reads
+            << ", \"pair_table_peak_bytes\": " << m_peak_bytes
+            << ", \"orphans\": " << m_orphans
+            << ", \"wall_seconds\": " << wall
+            << ", \"cpu_seconds\": " << cpu
+            << ", \"max_rss_kb\": " << usage.ru_maxrss
+            << ", \"stages\": {";
+        for (int i = 0; i < STAGES; i++)
+            out << (i ? ", " : "") << "\"" << stage_names[i] << "\": {\"wall_seconds\": "
+                << m_wall[i] << ", \"cpu_seconds\": " << m_cpu[i] << "}";
+        out << "}}" << endl;
+    } else {
+        out << "Stage         wall (s)    CPU (s)" << endl;
+        for (int i = 0; i < STAGES; i++)
+            out << left << setw(10) << stage_names[i] << right << setw(12) << m_wall[i]
+                << setw(11) << m_cpu[i] << endl;
+        out << left << setw(10) << "total" << right << setw(12) << wall << setw(11) << cpu << endl
+            << m_seen << " records read (" << setprecision(0) << rate << " a second), "
+            << m_exported << " exported" << endl
+            << m_bytes_in << " bytes of BAM records in, " << m_bytes_out << " bytes written" << endl
+            << "At most " << m_peak_reads << " reads (" << m_peak_bytes
+            << " bytes) waiting for their mates" << endl
+            << m_orphans << " reads written without their mates" << endl
+            << "Peak memory " << usage.ru_maxrss << "K" << endl;
+    }
+    out.flags(flags);
+    out.precision(precision);
+}
+
+StageTimer::StageTimer(Stats::Stage stage)
+    : m_stage(stage), m_stats(Stats::current), m_wall(0), m_cpu(0), m_outer(NULL),
+      m_inner_wall(0), m_inner_cpu(0) {
+    if (m_stats) {
+        m_wall = wall_clock();
+        m_cpu = thread_cpu();
+        m_outer = current_timer;
+        current_timer = this;
+    }
+}
+
+StageTimer::~StageTimer() {
+    if (!m_stats)
+        return;
+    double wall = wall_clock() - m_wall;
+    double cpu = thread_cpu() - m_cpu;
+    m_stats->add_time(m_stage, wall - m_inner_wall, cpu - m_inner_cpu);
+    if (m_outer) {
+        m_outer->m_inner_wall += wall;
+        m_outer->m_inner_cpu += cpu;
+    }
+    current_timer = m_outer;
+}
+
+Progress::Progress(double interval)
+    : m_interval(interval), m_start(wall_clock()), m_last(m_start) {}
+
+void Progress::update(size_t exported) {
+    if (m_interval <= 0)
+        return;
+    double now = wall_clock();
+    if (now - m_last < m_interval)
+        return;
+    m_last = now;
+    cerr << exported << " sequences exported in " << fixed << setprecision(0)
+         << now - m_start << "s (" << exported / (now - m_start) << " a second)" << endl;
+    cerr.unsetf(ios::floatfield);
+    cerr.precision(6);
+}
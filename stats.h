@@ -0,0 +1,99 @@
+/*
+Copyright 2010, HudsonAlpha Institute for Biotechnology
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+stats.h
+
+Timing and throughput figures for --stats and --progress
+*/
+
+#ifndef BAM2FASTQ_STATS_H
+#define BAM2FASTQ_STATS_H
+
+#include "threads.h"
+#include <iosfwd>
+#include <cstddef>
+
+//Totals for the whole run, added to from any thread.  Nothing is counted
+//unless a Stats has been made current, so the timers cost next to nothing
+//without --stats.
+class Stats {
+public:
+    enum Stage { READ, FORMAT, PAIR, COMPRESS, WRITE, STAGES };
+
+    Stats();
+
+    //The one being added to, or NULL
+    static Stats *current;
+
+    void add_time(Stage stage, double wall, double cpu);
+    void add_input_bytes(size_t bytes);
+    void add_output_bytes(size_t bytes);
+    //A read that was waiting for its mate, written on its own in the end
+    void add_orphans(size_t reads);
+    //Keeps the largest values seen
+    void pair_table_size(size_t reads, size_t bytes);
+    void set_records(size_t seen, size_t exported);
+
+    void report(std::ostream &out, bool json);
+
+private:
+    Stats(const Stats &);
+    Stats &operator=(const Stats &);
+
+    Mutex m_mutex;
+    double m_start;
+    double m_wall[STAGES];
+    double m_cpu[STAGES];
+    size_t m_bytes_in;
+    size_t m_bytes_out;
+    size_t m_orphans;
+    size_t m_peak_reads;
+    size_t m_peak_bytes;
+    size_t m_seen;
+    size_t m_exported;
+};
+
+//Adds the wall and CPU time of this thread between construction and
+//destruction to a stage.  Time spent in timers started inside it (the
+//write() under a flush, say) only counts for theirs.
+class StageTimer {
+public:
+    explicit StageTimer(Stats::Stage stage);
+    ~StageTimer();
+private:
+    StageTimer(const StageTimer &);
+    StageTimer &operator=(const StageTimer &);
+
+    Stats::Stage m_stage;
+    Stats *m_stats;
+    double m_wall;
+    double m_cpu;
+    //The timer this one is inside, and the time spent in timers inside it
+    StageTimer *m_outer;
+    double m_inner_wall;
+    double m_inner_cpu;
+};
+
+//Prints how far we've got to stderr, at most every interval seconds
+class Progress {
+public:
+    explicit Progress(double interval);
+    void update(size_t exported);
+private:
+    double m_interval;
+    double m_start;
+    double m_last;
+};
+
+#endif
@@ -0,0 +1,296 @@
+/*
+Copyright 2010, HudsonAlpha Institute for Biotechnology
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+threads.h
+
+Small pthread helpers shared by the threaded parts of bam2fastq
+*/
+
+#ifndef BAM2FASTQ_THREADS_H
+#define BAM2FASTQ_THREADS_H
+
+#include <pthread.h>
+#include <deque>
+#include <vector>
+
+//We link with -pthread anyway (for libbam), and this keeps us building
+//with compilers that don't default to C++11
+class Mutex {
+public:
+    Mutex() { pthread_mutex_init(&m_mutex, NULL); }
+    ~Mutex() { pthread_mutex_destroy(&m_mutex); }
+    void lock() { pthread_mutex_lock(&m_mutex); }
+    void unlock() { pthread_mutex_unlock(&m_mutex); }
+    pthread_mutex_t *native() { return &m_mutex; }
+private:
+    Mutex(const Mutex &);
+    Mutex &operator=(const Mutex &);
+    pthread_mutex_t m_mutex;
+};
+
+class ScopedLock {
+public:
+    explicit ScopedLock(Mutex &m) : m_mutex(m) { m_mutex.lock(); }
+    ~ScopedLock() { m_mutex.unlock(); }
+private:
+    ScopedLock(const ScopedLock &);
+    ScopedLock &operator=(const ScopedLock &);
+    Mutex &m_mutex;
+};
+
+class Condition {
+public:
+    Condition() { pthread_cond_init(&m_cond, NULL); }
+    ~Condition() { pthread_cond_destroy(&m_cond); }
+    void wait(Mutex &m) { pthread_cond_wait(&m_cond, m.native()); }
+    void signal() { pthread_cond_signal(&m_cond); }
+    void broadcast() { pthread_cond_broadcast(&m_cond); }
+private:
+    Condition(const Condition &);
+    Condition &operator=(const Condition &);
+    pthread_cond_t m_cond;
+};
+
+//Told on each thread Thread and OrderedPool start, as it begins and just
+//before it ends - so it can be pinned to a CPU, say
+class ThreadObserver {
+public:
+    virtual ~ThreadObserver() {}
+    virtual void started() = 0;
+    virtual void finished() = 0;
+};
+
+//The one to tell, or NULL.  Only set it while no threads are running.
+inline ThreadObserver *&thread_observer() {
+    static ThreadObserver *observer = NULL;
+    return observer;
+}
+
+//Calls task.run() on a new thread.  The task has to outlive the thread.
+template<typename Task>
+class Thread {
+public:
+    explicit Thread(Task &task) : m_joined(false) {
+        pthread_create(&m_thread, NULL, &Thread::thread_main, &task);
+    }
+    ~Thread() { join(); }
+    void join() {
+        if (!m_joined)
+            pthread_join(m_thread, NULL);
+        m_joined = true;
+    }
+private:
+    Thread(const Thread &);
+    Thread &operator=(const Thread &);
+
+    static void *thread_main(void *arg) {
+        ThreadObserver *observer = thread_observer();
+        if (observer)
+            observer->started();
+        static_cast<Task *>(arg)->run();
+        if (observer)
+            observer->finished();
+        return NULL;
+    }
+
+    pthread_t m_thread;
+    bool m_joined;
+};
+
+//A bounded queue with any number of producers.  Once every producer has
+//called close(), pop() returns false as soon as the queue is empty.
+template<typename T>
+class BlockingQueue {
+public:
+    explicit BlockingQueue(size_t capacity, int producers = 1)
+        : m_capacity(capacity), m_producers(producers) {}
+
+    void push(const T &item) {
+        ScopedLock lock(m_mutex);
+        while (m_items.size() >= m_capacity)
+            m_not_full.wait(m_mutex);
+        m_items.push_back(item);
+        m_not_empty.signal();
+    }
+
+    bool pop(T &item) {
+        ScopedLock lock(m_mutex);
+        while (m_items.empty()) {
+            if (m_producers == 0)
+                return false;
+            m_not_empty.wait(m_mutex);
+        }
+        item = m_items.front();
+        m_items.pop_front();
+        m_not_full.signal();
+        return true;
+    }
+
+    void close() {
+        ScopedLock lock(m_mutex);
+        m_producers--;
+        m_not_empty.broadcast();
+    }
+
+private:
+    BlockingQueue(const BlockingQueue &);
+    BlockingQueue &operator=(const BlockingQueue &);
+
+    std::deque<T> m_items;
+    size_t m_capacity;
+    int m_producers;
+    Mutex m_mutex;
+    Condition m_not_empty;
+    Condition m_not_full;
+};
+
+//Runs jobs on a pool of worker threads, but hands them back in the order
+//they were submitted.  There is one producer (acquire/submit/finish) and
+//one consumer (next/release), which may be the same thread.  The pool owns
+//a fixed ring of `depth` jobs, so the producer blocks once it gets that far
+//ahead of the consumer.  Job must be default-constructible and provide run().
+template<typename Job>
+class OrderedPool {
+public:
+    OrderedPool(int threads, int depth)
+        : m_jobs(depth), m_state(depth, FREE), m_head(0), m_tail(0),
+          m_finished(false), m_stopping(false) {
+        for (size_t i = 0; i < m_jobs.size(); i++)
+            m_jobs[i] = new Job();
+        m_threads.resize(threads);
+        for (size_t i = 0; i < m_threads.size(); i++)
+            pthread_create(&m_threads[i], NULL, &OrderedPool::worker_main, this);
+    }
+
+    ~OrderedPool() {
+        m_mutex.lock();
+        m_stopping = true;
+        m_work.broadcast();
+        m_mutex.unlock();
+        for (size_t i = 0; i < m_threads.size(); i++)
+            pthread_join(m_threads[i], NULL);
+        for (size_t i = 0; i < m_jobs.size(); i++)
+            delete m_jobs[i];
+    }
+
+    size_t depth() const { return m_jobs.size(); }
+
+    //Producer side.  Don't call from the consumer when full(), it would
+    //never return
+    bool full() {
+        ScopedLock lock(m_mutex);
+        return m_state[m_head % m_jobs.size()] != FREE;
+    }
+
+    Job *acquire() {
+        ScopedLock lock(m_mutex);
+        size_t slot = m_head % m_jobs.size();
+        while (m_state[slot] != FREE)
+            m_free.wait(m_mutex);
+        m_state[slot] = ACQUIRED;
+        m_head++;
+        return m_jobs[slot];
+    }
+
+    void submit(Job *job) {
+        ScopedLock lock(m_mutex);
+        size_t slot = index_of(job);
+        m_state[slot] = QUEUED;
+        m_queue.push_back(slot);
+        m_work.signal();
+    }
+
+    //No more jobs are coming; next() returns NULL once the ring drains
+    void finish() {
+        ScopedLock lock(m_mutex);
+        m_finished = true;
+        m_done.broadcast();
+    }
+
+    //Consumer side
+    Job *next() {
+        ScopedLock lock(m_mutex);
+        size_t slot = m_tail % m_jobs.size();
+        while (m_state[slot] != DONE) {
+            if (m_finished && m_tail == m_head)
+                return NULL;
+            m_done.wait(m_mutex);
+        }
+        m_tail++;
+        return m_jobs[slot];
+    }
+
+    void release(Job *job) {
+        ScopedLock lock(m_mutex);
+        m_state[index_of(job)] = FREE;
+        m_free.broadcast();
+    }
+
+private:
+    enum { FREE, ACQUIRED, QUEUED, DONE };
+
+    OrderedPool(const OrderedPool &);
+    OrderedPool &operator=(const OrderedPool &);
+
+    size_t index_of(const Job *job) const {
+        for (size_t i = 0; i < m_jobs.size(); i++)
+            if (m_jobs[i] == job)
+                return i;
+        return m_jobs.size();
+    }
+
+    static void *worker_main(void *arg) {
+        ThreadObserver *observer = thread_observer();
+        if (observer)
+            observer->started();
+        static_cast<OrderedPool *>(arg)->work();
+        if (observer)
+            observer->finished();
+        return NULL;
+    }
+
+    void work() {
+        m_mutex.lock();
+        while (true) {
+            while (m_queue.empty() && !m_stopping)
+                m_work.wait(m_mutex);
+            if (m_stopping)
+                break;
+            size_t slot = m_queue.front();
+            m_queue.pop_front();
+            m_mutex.unlock();
+            m_jobs[slot]->run();
+            m_mutex.lock();
+            m_state[slot] = DONE;
+            m_done.broadcast();
+        }
+        m_mutex.unlock();
+    }
+
+    std::vector<Job *> m_jobs;
+    std::vector<int> m_state;
+    std::deque<size_t> m_queue;
+    size_t m_head;
+    size_t m_tail;
+    bool m_finished;
+    bool m_stopping;
+    Mutex m_mutex;
+    Condition m_work;
+    Condition m_done;
+    Condition m_free;
+    std::vector<pthread_t> m_threads;
+};
+
+#endif